@@ -54,6 +54,51 @@ def make_header():
     file.close()
 
 
+def make_keymap():
+    types = { 'KEY': 'KEYBOARD_KEY', 'MODIFIER': 'KEYBOARD_MODIFIER', 'BUTTON': 'MOUSE_BUTTON' }
+    size = 0x200
+    keymap = [None] * size
+
+    src = open('src\\xenhid\\keymap.txt', 'r')
+
+    for number, line in enumerate(src, 1):
+        line = line.split('#')[0].strip()
+        if not line:
+            continue
+
+        item = line.split()
+        if len(item) != 3 or item[2] not in types:
+            raise Exception('keymap.txt:%d: bad entry' % number)
+
+        code = int(item[0], 0)
+        usage = int(item[1], 0)
+        if code >= size or usage > 0xFF:
+            raise Exception('keymap.txt:%d: out of range' % number)
+        if keymap[code] is not None:
+            raise Exception('keymap.txt:%d: duplicate code %d' % (number, code))
+
+        keymap[code] = (types[item[2]], usage)
+
+    src.close()
+
+    file = open('include\\keymap.h', 'w')
+    file.write('// Generated by build.py from src\\xenhid\\keymap.txt\n')
+    file.write('\n')
+    file.write('#define VKBD_KEYMAP_SIZE\t' + hex(size) + '\n')
+    file.write('\n')
+    file.write('static const VKBD_KEYMAP_ENTRY\n')
+    file.write('VkbdKeymap[VKBD_KEYMAP_SIZE] = {\n')
+
+    for code in range(size):
+        if keymap[code] is None:
+            file.write('\t{ 0, 0x00 },\t// %#05x\n' % code)
+        else:
+            file.write('\t{ %s, 0x%02X },\t// %#05x\n' % (keymap[code][0], keymap[code][1], code))
+
+    file.write('};\n')
+    file.close()
+
+
 def copy_inf(name):
     src = open('src\\%s.inf' % name, 'r')
     dst = open('proj\\%s.inf' % name, 'w')
@@ -282,6 +327,7 @@ if __name__ == '__main__':
         revision.close()
 
     make_header()
+    make_keymap()
 
     copy_inf(driver)
 
@@ -44,6 +44,7 @@ extern PULONG       InitSafeBootMode;
 
 typedef struct _XENHID_DRIVER {
     PDRIVER_OBJECT      DriverObject;
+    XENHID_PARAMETERS   Parameters;
 } XENHID_DRIVER, *PXENHID_DRIVER;
 
 static XENHID_DRIVER    Driver;
@@ -72,6 +73,112 @@ DriverGetDriverObject(
     return __DriverGetDriverObject();
 }
 
+const XENHID_PARAMETERS*
+DriverGetParameters(
+    VOID
+    )
+{
+    return &Driver.Parameters;
+}
+
+#define __WIDEN(_String)    L ## _String
+#define WIDEN(_String)      __WIDEN(_String)
+
+#define DRIVER_PARAMETER(_Name)                                       \
+    {                                                                 \
+        NULL,                                                         \
+        RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,     \
+        WIDEN(#_Name),                                                \
+        &Driver.Parameters._Name,                                     \
+        (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE, \
+        NULL,                                                         \
+        0                                                             \
+    }
+
+static VOID
+DriverReadParameters(
+    IN  PUNICODE_STRING RegistryPath
+    )
+{
+    OBJECT_ATTRIBUTES           Attributes;
+    UNICODE_STRING              Name;
+    HANDLE                      ServiceKey;
+    HANDLE                      ParametersKey;
+    RTL_QUERY_REGISTRY_TABLE    Table[] = {
+        DRIVER_PARAMETER(PollInterval),
+        DRIVER_PARAMETER(DpcEventBudget),
+        DRIVER_PARAMETER(DpcTimeBudget),
+        DRIVER_PARAMETER(AbsPointer),
+        DRIVER_PARAMETER(FlowControl),
+        DRIVER_PARAMETER(InRingPageOrder),
+        DRIVER_PARAMETER(Timestamps),
+        DRIVER_PARAMETER(PointerInterval),
+        DRIVER_PARAMETER(PointerBound),
+        DRIVER_PARAMETER(Nkro),
+        { NULL, 0, NULL }
+    };
+    NTSTATUS                    status;
+
+    // Defaults, used for anything not present in the registry
+    Driver.Parameters.PollInterval = 0;
+    Driver.Parameters.DpcEventBudget = 256;
+    Driver.Parameters.DpcTimeBudget = 500;
+    Driver.Parameters.AbsPointer = 1;
+    Driver.Parameters.FlowControl = 1;
+    Driver.Parameters.InRingPageOrder = 2;
+    Driver.Parameters.Timestamps = 0;
+    Driver.Parameters.PointerInterval = 4000;
+    Driver.Parameters.PointerBound = 20000;
+    Driver.Parameters.Nkro = 0;
+
+    InitializeObjectAttributes(&Attributes,
+                               RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwOpenKey(&ServiceKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    RtlInitUnicodeString(&Name, L"Parameters");
+
+    InitializeObjectAttributes(&Attributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               ServiceKey,
+                               NULL);
+
+    status = ZwOpenKey(&ParametersKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = RtlQueryRegistryValues(RTL_REGISTRY_HANDLE,
+                                    (PWSTR)ParametersKey,
+                                    Table,
+                                    NULL,
+                                    NULL);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    ZwClose(ParametersKey);
+    ZwClose(ServiceKey);
+
+    return;
+
+fail3:
+    ZwClose(ParametersKey);
+
+fail2:
+    ZwClose(ServiceKey);
+
+fail1:
+    // No Parameters key is fine: keep the defaults
+    Trace("defaults (%08x)\n", status);
+}
+
+#undef  DRIVER_PARAMETER
+
 PXENHID_FDO
 DriverGetFdo(
     IN  PDEVICE_OBJECT      DeviceObject
@@ -103,6 +210,8 @@ DriverUnload(
 
     __DriverSetDriverObject(NULL);
 
+    RtlZeroMemory(&Driver.Parameters, sizeof (XENHID_PARAMETERS));
+
     ASSERT(IsZeroMemory(&Driver, sizeof (XENHID_DRIVER)));
 
     Trace("<====\n");
@@ -185,6 +294,8 @@ DriverEntry(
          MONTH,
          YEAR);
 
+    DriverReadParameters(RegistryPath);
+
     DriverObject->DriverExtension->AddDevice = AddDevice;
 
     for (Index = 0; Index <= IRP_MJ_MAXIMUM_FUNCTION; Index++) {
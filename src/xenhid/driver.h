@@ -36,6 +36,25 @@
 
 typedef struct _XENHID_FDO      XENHID_FDO, *PXENHID_FDO;
 
+// Tunables, read from the service's Parameters key at load
+typedef struct _XENHID_PARAMETERS {
+    ULONG   PollInterval;     // us before re-polling a busy ring (0 = immediately)
+    ULONG   DpcEventBudget;   // max events consumed per DPC (0 = unlimited)
+    ULONG   DpcTimeBudget;    // max us spent consuming per DPC (0 = unlimited)
+    ULONG   AbsPointer;       // request absolute positions if the backend offers them
+    ULONG   FlowControl;      // leave events on the ring while no reads are queued
+    ULONG   InRingPageOrder;  // max order of an extended in-ring (0 = legacy only)
+    ULONG   Timestamps;       // collect per-stage input latency histograms
+    ULONG   PointerInterval;  // min us between pointer motion reports (0 = no limit)
+    ULONG   PointerBound;     // max us motion waits behind keyboard reports (0 = none)
+    ULONG   Nkro;             // report every held key, not just 6 (needs a reinstall)
+} XENHID_PARAMETERS, *PXENHID_PARAMETERS;
+
+extern const XENHID_PARAMETERS*
+DriverGetParameters(
+    VOID
+    );
+
 extern PDRIVER_OBJECT
 DriverGetDriverObject(
     VOID
@@ -51,7 +51,6 @@
 #include "dbg_print.h"
 #include "assert.h"
 
-#define MAXIRPCACHE             4
 #define MAXNAMELEN              128
 
 typedef enum _DEVICE_PNP_STATE {
@@ -80,7 +79,12 @@ struct _XENHID_FDO {
 
     BOOLEAN                     Enabled;
     KSPIN_LOCK                  Lock;
-    PIRP                        Irps[MAXIRPCACHE];
+    IO_CSQ                      Queue;
+    LIST_ENTRY                  List;
+    ULONG                       NumQueued;
+    ULONG                       MaxQueued;
+    ULONG                       NumCancelled;
+    ULONG                       NumShort;
 
     PXENBUS_STORE_INTERFACE     StoreInterface;
     PXENBUS_DEBUG_INTERFACE     DebugInterface;
@@ -164,6 +168,8 @@ __FdoGetSystemPowerState(
     return Fdo->SystemPowerState;
 }
 
+// XENBUS enumerates one PDO per device class, so there is one FDO and
+// it drives the first vkbd node
 static FORCEINLINE PCHAR
 __FdoGetStorePath(
     IN  PXENHID_FDO     Fdo
@@ -181,33 +187,119 @@ FdoGetStorePath(
     return __FdoGetStorePath(Fdo);
 }
 
-static FORCEINLINE NTSTATUS
-__FdoCache(
-    IN  PXENHID_FDO     Fdo,
-    IN  PIRP            Irp
+// Pending reads are kept in a cancel-safe queue. The callbacks below run
+// with Fdo->Lock held and do nothing but link or unlink the IRP.
+
+IO_CSQ_INSERT_IRP_EX FdoCsqInsertIrpEx;
+
+NTSTATUS
+FdoCsqInsertIrpEx(
+    IN  PIO_CSQ         Csq,
+    IN  PIRP            Irp,
+    IN  PVOID           InsertContext
     )
 {
-    NTSTATUS    status;
-    ULONG       Index;
-    KIRQL       Irql;
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
 
-    status = STATUS_DEVICE_NOT_READY;
+    UNREFERENCED_PARAMETER(InsertContext);
+
+    // checked under the lock so nothing is queued once paused
     if (Fdo->Enabled == FALSE)
-        goto done;
+        return STATUS_DEVICE_NOT_READY;
+
+    InsertTailList(&Fdo->List, &Irp->Tail.Overlay.ListEntry);
+
+    if (++Fdo->NumQueued > Fdo->MaxQueued)
+        Fdo->MaxQueued = Fdo->NumQueued;
+
+    return STATUS_SUCCESS;
+}
+
+IO_CSQ_REMOVE_IRP FdoCsqRemoveIrp;
+
+VOID
+FdoCsqRemoveIrp(
+    IN  PIO_CSQ         Csq,
+    IN  PIRP            Irp
+    )
+{
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    --Fdo->NumQueued;
+}
+
+IO_CSQ_PEEK_NEXT_IRP FdoCsqPeekNextIrp;
+
+PIRP
+FdoCsqPeekNextIrp(
+    IN  PIO_CSQ         Csq,
+    IN  PIRP            Irp,
+    IN  PVOID           PeekContext
+    )
+{
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+    PLIST_ENTRY     ListEntry;
+
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    ListEntry = (Irp == NULL) ? Fdo->List.Flink : Irp->Tail.Overlay.ListEntry.Flink;
+    if (ListEntry == &Fdo->List)
+        return NULL;
+
+    return CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+}
+
+IO_CSQ_ACQUIRE_LOCK FdoCsqAcquireLock;
+
+VOID
+FdoCsqAcquireLock(
+    IN  PIO_CSQ         Csq,
+    OUT PKIRQL          Irql
+    )
+{
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+
+    KeAcquireSpinLock(&Fdo->Lock, Irql);
+}
+
+IO_CSQ_RELEASE_LOCK FdoCsqReleaseLock;
+
+VOID
+FdoCsqReleaseLock(
+    IN  PIO_CSQ         Csq,
+    IN  KIRQL           Irql
+    )
+{
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
 
-    status = STATUS_UNSUCCESSFUL;
-    KeAcquireSpinLock(&Fdo->Lock, &Irql);
-    for (Index = 0; Index < MAXIRPCACHE; ++Index) {
-        if (Fdo->Irps[Index] == NULL) {
-            Fdo->Irps[Index] = Irp;
-            status = STATUS_SUCCESS;
-            break;
-        }
-    }
     KeReleaseSpinLock(&Fdo->Lock, Irql);
+}
 
-done:
-    return status;
+IO_CSQ_COMPLETE_CANCELED_IRP FdoCsqCompleteCanceledIrp;
+
+VOID
+FdoCsqCompleteCanceledIrp(
+    IN  PIO_CSQ         Csq,
+    IN  PIRP            Irp
+    )
+{
+    PXENHID_FDO     Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+
+    ++Fdo->NumCancelled;
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static FORCEINLINE NTSTATUS
+__FdoCache(
+    IN  PXENHID_FDO     Fdo,
+    IN  PIRP            Irp
+    )
+{
+    return IoCsqInsertIrpEx(&Fdo->Queue, Irp, NULL, NULL);
 }
 
 static FORCEINLINE PIRP
@@ -215,26 +307,43 @@ __FdoUncache(
     IN  PXENHID_FDO     Fdo
     )
 {
-    KIRQL       Irql;
-    ULONG       Index;
-    PIRP        Irp;
+    return IoCsqRemoveNextIrp(&Fdo->Queue, NULL);
+}
 
-    Irp = NULL;
-    KeAcquireSpinLock(&Fdo->Lock, &Irql);
-    for (Index = 0; Index < MAXIRPCACHE; ++Index) {
-        if (Fdo->Irps[Index] != NULL) {
-            Irp = Fdo->Irps[Index];
-            for (; Index < MAXIRPCACHE-1; ++Index) 
-                Fdo->Irps[Index] = Fdo->Irps[Index+1];
-            Fdo->Irps[MAXIRPCACHE-1] = NULL;
+// Take the oldest pending read whose buffer can hold Length bytes.
+// Any read ahead of it that is too short for the report is failed
+// rather than left to block the queue.
+static PIRP
+__FdoDequeueRead(
+    IN  PXENHID_FDO     Fdo,
+    IN  ULONG           Length
+    )
+{
+    PIRP                Irp;
+    PIO_STACK_LOCATION  StackLocation;
+
+    for (;;) {
+        Irp = __FdoUncache(Fdo);
+        if (Irp == NULL)
             break;
-        }
+
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+        if (Irp->UserBuffer != NULL &&
+            StackLocation->Parameters.DeviceIoControl.OutputBufferLength >= Length)
+            break;
+
+        ++Fdo->NumShort;
+
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
     }
-    KeReleaseSpinLock(&Fdo->Lock, Irql);
 
     return Irp;
 }
 
+// The report goes straight from the caller's state into the read's
+// buffer, once that buffer is known to be big enough
 NTSTATUS
 FdoCompleteRead(
     IN  PXENHID_FDO         Fdo,
@@ -246,11 +355,10 @@ FdoCompleteRead(
     PIRP        Irp;
     
     status = STATUS_DEVICE_NOT_READY;
-    Irp = __FdoUncache(Fdo);
+    Irp = __FdoDequeueRead(Fdo, Length);
     if (Irp == NULL)
         goto done;
 
-    // should check buffer sizes and fail if wrong
     RtlCopyMemory(Irp->UserBuffer, Buffer, Length);
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = Length;
@@ -267,7 +375,12 @@ FdoPauseData(
     IN  PXENHID_FDO     Fdo
     )
 {
+    KIRQL           Irql;
+
+    // under the queue lock, so no read can be queued after the drain
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
     Fdo->Enabled = FALSE;
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
 
     for (;;) {
         PIRP    Irp = __FdoUncache(Fdo);
@@ -350,7 +463,6 @@ FdoDebugCallback(
     IN  BOOLEAN     Crashing
     )
 {
-    ULONG           Index;
     PXENHID_FDO     Fdo = Context;
 
     UNREFERENCED_PARAMETER(Crashing);
@@ -367,14 +479,18 @@ FdoDebugCallback(
             "%s\n", 
             Fdo->Enabled ? "WORKING" : "PAUSED");
 
-    for (Index = 0; Index < MAXIRPCACHE; ++Index) {
-        DEBUG(Printf,
-                Fdo->DebugInterface,
-                Fdo->DebugCallback,
-                "IRPs[%d] = 0x%p\n",
-                Index,
-                Fdo->Irps[Index]);
-    }
+    DEBUG(Printf,
+            Fdo->DebugInterface,
+            Fdo->DebugCallback,
+            "Reads: %u queued (max %u) Cancelled: %u Short: %u\n",
+            Fdo->NumQueued,
+            Fdo->MaxQueued,
+            Fdo->NumCancelled,
+            Fdo->NumShort);
+
+    FrontendDebugCallback(Fdo->Frontend,
+                          Fdo->DebugInterface,
+                          Fdo->DebugCallback);
 }
 
 static FORCEINLINE NTSTATUS
@@ -446,12 +562,9 @@ FdoSuspendCallback(
     )
 {
     PXENHID_FDO Fdo = Argument;
-    NTSTATUS    status;
 
-    __FdoD0ToD3(Fdo);
-
-    status = __FdoD3ToD0(Fdo);
-    ASSERT(NT_SUCCESS(status));
+    // the frontend thread re-connects to the new backend
+    FrontendResume(Fdo->Frontend);
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -506,6 +619,8 @@ fail1:
 
     KeLowerIrql(Irql);
 
+    (VOID) FrontendWait(Fdo->Frontend);
+
     return status;
 }
 
@@ -539,6 +654,9 @@ FdoD0ToD3(
     __FdoD0ToD3(Fdo);
 
     KeLowerIrql(Irql);
+
+    // the frontend thread closes the backend connection
+    (VOID) FrontendWait(Fdo->Frontend);
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -559,6 +677,8 @@ FdoStartDevice(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    // The frontend thread runs the backend handshake; reads queue
+    // up until it has connected
     FdoResumeData(Fdo);
 
     __FdoSetDevicePnpState(Fdo, Started);
@@ -849,6 +969,7 @@ FdoDispatchControl(
     PIO_STACK_LOCATION  StackLocation;
     ULONG               ControlCode;
     PVOID               Buffer;
+    PHID_XFER_PACKET    Packet;
     ULONG               InputLength;
     ULONG               OutputLength;
     ULONG_PTR           Information;
@@ -856,6 +977,7 @@ FdoDispatchControl(
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     Buffer = Irp->UserBuffer;
+    Packet = Irp->UserBuffer;
     ControlCode = StackLocation->Parameters.DeviceIoControl.IoControlCode;
     InputLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
     OutputLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
@@ -871,20 +993,49 @@ FdoDispatchControl(
     case IOCTL_HID_GET_REPORT_DESCRIPTOR:
         status = FrontendGetReportDescriptor(Fdo->Frontend, Buffer, OutputLength, &Information);
         break;
+    // These carry a HID_XFER_PACKET describing the report buffer
     case IOCTL_HID_GET_FEATURE:
-        status = FrontendGetFeature(Fdo->Frontend, Buffer, OutputLength, &Information);
+        status = STATUS_INVALID_PARAMETER;
+        if (Packet == NULL)
+            break;
+        status = FrontendGetFeature(Fdo->Frontend, Packet->reportBuffer, Packet->reportBufferLen, &Information);
         break;
     case IOCTL_HID_SET_FEATURE:
-        status = FrontendSetFeature(Fdo->Frontend, Buffer, OutputLength);
+        status = STATUS_INVALID_PARAMETER;
+        if (Packet == NULL)
+            break;
+        status = FrontendSetFeature(Fdo->Frontend, Packet->reportBuffer, Packet->reportBufferLen);
+        break;
+    // Answered from the current state, not queued like a read
+    case IOCTL_HID_GET_INPUT_REPORT:
+        status = STATUS_INVALID_PARAMETER;
+        if (Packet == NULL)
+            break;
+        status = FrontendGetInputReport(Fdo->Frontend, Packet->reportId, Packet->reportBuffer, Packet->reportBufferLen, &Information);
         break;
     case IOCTL_HID_WRITE_REPORT:
-        status = FrontendWriteReport(Fdo->Frontend, Buffer, OutputLength);
+    case IOCTL_HID_SET_OUTPUT_REPORT:
+        status = STATUS_INVALID_PARAMETER;
+        if (Packet == NULL)
+            break;
+        status = FrontendWriteReport(Fdo->Frontend, Packet->reportBuffer, Packet->reportBufferLen);
+        if (NT_SUCCESS(status))
+            Information = Packet->reportBufferLen;
         break;
     case IOCTL_HID_READ_REPORT:
+        // The IRP can be completed by the DPC as soon as it is cached,
+        // so it has to be marked pending first
+        IoMarkIrpPending(Irp);
+
         status = __FdoCache(Fdo, Irp);
-        if (status == STATUS_PENDING)
-            status = FrontendReadReport(Fdo->Frontend);
-        break;
+        if (NT_SUCCESS(status)) {
+            (VOID) FrontendReadReport(Fdo->Frontend);
+        } else {
+            Irp->IoStatus.Status = status;
+            Irp->IoStatus.Information = 0;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        }
+        return STATUS_PENDING;
 
     default:
         status = STATUS_NOT_SUPPORTED;
@@ -1079,6 +1230,16 @@ FdoCreate(
         goto fail6;
 
     KeInitializeSpinLock(&Fdo->Lock);
+    InitializeListHead(&Fdo->List);
+
+    status = IoCsqInitializeEx(&Fdo->Queue,
+                               FdoCsqInsertIrpEx,
+                               FdoCsqRemoveIrp,
+                               FdoCsqPeekNextIrp,
+                               FdoCsqAcquireLock,
+                               FdoCsqReleaseLock,
+                               FdoCsqCompleteCanceledIrp);
+    ASSERT(NT_SUCCESS(status));
 
     Info("%p (%s)\n",
          DeviceObject,
@@ -1139,6 +1300,12 @@ FdoDestroy(
     Fdo->DebugInterface = NULL;
     Fdo->StoreInterface = NULL;
 
+    ASSERT(IsListEmpty(&Fdo->List));
+    RtlZeroMemory(&Fdo->List, sizeof(LIST_ENTRY));
+    RtlZeroMemory(&Fdo->Queue, sizeof(IO_CSQ));
+    Fdo->NumQueued = Fdo->MaxQueued = Fdo->NumCancelled = 0;
+    Fdo->NumShort = 0;
+
     RtlZeroMemory(&Fdo->Lock, sizeof(KSPIN_LOCK));
 
     Fdo->LowerDeviceObject = NULL;
@@ -34,21 +34,76 @@
 #include "fdo.h"
 #include "operations.h"
 #include "vkbd.h"
+#include "rawhid.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include <xen.h>
 #include <stdlib.h>
 
+// The close/connect handshake with the backend is run by a thread of
+// its own, woken by requests, backend state watches and a timeout.
+typedef enum _FRONTEND_STATE {
+    FRONTEND_IDLE = 0,      // nothing set up
+    FRONTEND_CLOSING,       // wrote Closing, waiting for the backend
+    FRONTEND_CLOSED,        // wrote Closed, waiting for the backend
+    FRONTEND_CONNECTING,    // our end connected, waiting for the backend
+    FRONTEND_CONNECTED,
+    FRONTEND_FAILED         // handshake failed; retried after a backoff
+} FRONTEND_STATE;
+
+#define FRONTEND_HANDSHAKE_TIMEOUT  120     // s, per backend state change
+
+// A failed handshake is retried after 1s, 2s, 4s... up to a minute
+#define FRONTEND_BACKOFF_MIN        1       // s
+#define FRONTEND_BACKOFF_MAX        64      // s
+
+// Longest output report kept for replay (VKBD's LED report is 2 bytes)
+#define FRONTEND_MAX_OUTPUT_REPORT  8
+
 struct _XENHID_FRONTEND {
     PXENHID_FDO             Fdo;
     BOOLEAN                 Connected;
+    EX_RUNDOWN_REF          Rundown;
 
-    PCHAR                   BackendPath;
+    KSPIN_LOCK              Lock;
+    BOOLEAN                 Enabled;
+    BOOLEAN                 Reset;
+    BOOLEAN                 Resume;
+    KEVENT                  Settled;
+    NTSTATUS                Status;
+
+    ULONG                   Protocol;
+    BOOLEAN                 Stale;
+    ULONG                   NumLookups;
+
+    PKTHREAD                Thread;
+    BOOLEAN                 Stop;
+    KEVENT                  Event;
+    FRONTEND_STATE          State;
+    KEVENT                  WatchEvent;
+    PXENBUS_STORE_WATCH     Watch;
+    KTIMER                  Timer;
+    ULONGLONG               Deadline;
+    ULONG                   NumHandshakes;
+    ULONG                   NumTimeouts;
+    ULONG                   NumResumes;
+    ULONG                   Backoff;
+    ULONG                   NumReconnects;
+    ULONG                   NumRetries;
+
+    PCHAR                   BackendPath;    // replaced under Lock
     USHORT                  BackendDomain;
 
     XENHID_OPERATIONS       Operations;
     PXENHID_CONTEXT         Context;
 
+    PUCHAR                  ReportDescriptor;   // as hidclass has it, under Lock
+    ULONG                   ReportDescriptorLength;
+
+    UCHAR                   OutputReport[FRONTEND_MAX_OUTPUT_REPORT];  // under Lock
+    ULONG                   OutputReportLength;
+    BOOLEAN                 OutputPending;
+
     PXENBUS_STORE_INTERFACE StoreInterface;
 };
 
@@ -95,12 +150,84 @@ XenbusStateName(
     }
 }
 
+static FORCEINLINE PCHAR
+__FrontendStateName(
+    IN  FRONTEND_STATE          State
+    )
+{
+    switch (State) {
+    case FRONTEND_IDLE:         return "IDLE";
+    case FRONTEND_CLOSING:      return "CLOSING";
+    case FRONTEND_CLOSED:       return "CLOSED";
+    case FRONTEND_CONNECTING:   return "CONNECTING";
+    case FRONTEND_CONNECTED:    return "CONNECTED";
+    case FRONTEND_FAILED:       return "FAILED";
+    default:                    return "<UNKNOWN>";
+    }
+}
+
+KSTART_ROUTINE  FrontendThread;
+
+// The protocol is fixed for the life of the device: hidclass only
+// asks for the descriptors once
+static NTSTATUS
+__FrontendInitialize(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    PCHAR       Buffer;
+    NTSTATUS    status;
+
+    STORE(Acquire, Frontend->StoreInterface);
+
+    // no protocol node means VKBD
+    status = STORE(Read,
+                   Frontend->StoreInterface,
+                   NULL,
+                   FdoGetStorePath(Frontend->Fdo),
+                   "protocol",
+                   &Buffer);
+    if (NT_SUCCESS(status)) {
+        Frontend->Protocol = (ULONG)strtoul(Buffer, NULL, 10);
+        STORE(Free, Frontend->StoreInterface, Buffer);
+    } else {
+        Frontend->Protocol = 0;
+    }
+
+    STORE(Release, Frontend->StoreInterface);
+
+    switch (Frontend->Protocol) {
+    case 0:
+        // VKBD
+        status = VkbdInitialize(&Frontend->Operations);
+        break;
+
+    case 1:
+        // Raw HID reports
+        status = RawHidInitialize(&Frontend->Operations);
+        break;
+
+    default:
+        status = STATUS_INVALID_PARAMETER;
+        break;
+    }
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x) protocol %u\n", status, Frontend->Protocol);
+    return status;
+}
+
 NTSTATUS
 FrontendCreate(
     IN  PXENHID_FDO             Fdo,
     OUT PXENHID_FRONTEND*       Frontend
     )
 {
+    HANDLE      Handle;
     NTSTATUS    status;
 
     status = STATUS_NO_MEMORY;
@@ -111,8 +238,55 @@ FrontendCreate(
     (*Frontend)->Fdo = Fdo;
     (*Frontend)->StoreInterface = FdoStoreInterface(Fdo);
 
+    (*Frontend)->Stale = TRUE;
+    (*Frontend)->Backoff = FRONTEND_BACKOFF_MIN;
+
+    status = __FrontendInitialize(*Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // run down until the first connection
+    ExInitializeRundownProtection(&(*Frontend)->Rundown);
+    ExWaitForRundownProtectionRelease(&(*Frontend)->Rundown);
+
+    KeInitializeSpinLock(&(*Frontend)->Lock);
+    KeInitializeEvent(&(*Frontend)->Settled, NotificationEvent, TRUE);
+    KeInitializeEvent(&(*Frontend)->Event, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&(*Frontend)->WatchEvent, NotificationEvent, FALSE);
+    KeInitializeTimerEx(&(*Frontend)->Timer, SynchronizationTimer);
+
+    status = PsCreateSystemThread(&Handle,
+                                  THREAD_ALL_ACCESS,
+                                  NULL,
+                                  NULL,
+                                  NULL,
+                                  FrontendThread,
+                                  *Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = ObReferenceObjectByHandle(Handle,
+                                       SYNCHRONIZE,
+                                       *PsThreadType,
+                                       KernelMode,
+                                       (PVOID*)&(*Frontend)->Thread,
+                                       NULL);
+    ZwClose(Handle);
+    ASSERT(NT_SUCCESS(status));
+
     return STATUS_SUCCESS;
 
+fail3:
+    Error("fail3\n");
+
+    RtlZeroMemory(&(*Frontend)->Operations, sizeof(XENHID_OPERATIONS));
+
+fail2:
+    Error("fail2\n");
+
+    __FrontendFree(*Frontend);
+    *Frontend = NULL;
+
 fail1:
     Error("fail1 (%08x)\n", status);
     return status;
@@ -123,9 +297,38 @@ FrontendDestroy(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
+    // only ever destroyed once disabled and idle
+    ASSERT3U(Frontend->State, ==, FRONTEND_IDLE);
+
+    Frontend->Stop = TRUE;
+    KeSetEvent(&Frontend->Event, IO_NO_INCREMENT, FALSE);
+
+    (VOID) KeWaitForSingleObject(Frontend->Thread,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+    ObDereferenceObject(Frontend->Thread);
+    Frontend->Thread = NULL;
+    Frontend->Stop = FALSE;
+
     Frontend->Fdo = NULL;
     Frontend->Connected = FALSE;
     Frontend->StoreInterface = NULL;
+    Frontend->Enabled = Frontend->Reset = FALSE;
+    Frontend->Status = STATUS_SUCCESS;
+    Frontend->NumHandshakes = Frontend->NumTimeouts = 0;
+    RtlZeroMemory(&Frontend->Operations, sizeof(XENHID_OPERATIONS));
+    Frontend->Protocol = 0;
+    Frontend->Stale = FALSE;
+    Frontend->NumLookups = 0;
+    Frontend->Resume = FALSE;
+    Frontend->NumResumes = 0;
+    Frontend->Backoff = 0;
+    Frontend->NumReconnects = Frontend->NumRetries = 0;
+    RtlZeroMemory(Frontend->OutputReport, sizeof(Frontend->OutputReport));
+    Frontend->OutputReportLength = 0;
+    Frontend->OutputPending = FALSE;
 
     Trace("(%s)-%u\n", Frontend->BackendPath, Frontend->BackendDomain);
 
@@ -134,234 +337,315 @@ FrontendDestroy(
     Frontend->BackendPath = NULL;
     Frontend->BackendDomain = 0;
 
+    if (Frontend->ReportDescriptor)
+        __FrontendFree(Frontend->ReportDescriptor);
+    Frontend->ReportDescriptor = NULL;
+    Frontend->ReportDescriptorLength = 0;
+
     __FrontendFree(Frontend);
 }
 
 static FORCEINLINE NTSTATUS
 __FrontendSetState(
-    IN  PXENHID_FRONTEND        Frontend,
-    IN  XenbusState             State
+    IN  PXENHID_FRONTEND            Frontend,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  XenbusState                 State
     )
 {
     return STORE(Printf, 
                 Frontend->StoreInterface, 
-                NULL, 
+                Transaction, 
                 FdoGetStorePath(Frontend->Fdo), 
                 "state", 
                 "%u", 
                 (ULONG)State);
 }
 
-static NTSTATUS
-__FrontendWaitState(
-    IN  PXENHID_FRONTEND        Frontend,
-    IN OUT XenbusState*         State
+static XenbusState
+__FrontendGetBackendState(
+    IN  PXENHID_FRONTEND        Frontend
     )
 {
-    KEVENT                  Event;
-    PXENBUS_STORE_WATCH     Watch;
-    LARGE_INTEGER           Start;
-    ULONGLONG               TimeDelta;
-    LARGE_INTEGER           Timeout;
-    XenbusState             Old = *State;
-    NTSTATUS                status;
-
-    Trace("%s: ====> (%s)\n", Frontend->BackendPath, XenbusStateName(*State));
-
-    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+    PCHAR           Buffer;
+    XenbusState     State;
+    NTSTATUS        status;
 
-    status = STORE(Watch,
+    status = STORE(Read,
                    Frontend->StoreInterface,
+                   NULL,
                    Frontend->BackendPath,
                    "state",
-                   &Event,
-                   &Watch);
-    if (!NT_SUCCESS(status))
-        goto fail1;
-
-    KeQuerySystemTime(&Start);
-    TimeDelta = 0;
+                   &Buffer);
+    if (!NT_SUCCESS(status)) {
+        // the backend may have been moved: look it up again next time
+        Frontend->Stale = TRUE;
+        return XenbusStateUnknown;
+    }
 
-    Timeout.QuadPart = 0;
+    State = (XenbusState)strtol(Buffer, NULL, 10);
 
-    while (*State == Old && TimeDelta < 120000) {
-        ULONG           Attempt;
-        PCHAR           Buffer;
-        LARGE_INTEGER   Now;
+    STORE(Free,
+          Frontend->StoreInterface,
+          Buffer);
 
-        Attempt = 0;
-        while (++Attempt < 1000) {
-            status = KeWaitForSingleObject(&Event,
-                                           Executive,
-                                           KernelMode,
-                                           FALSE,
-                                           &Timeout);
-            if (status != STATUS_TIMEOUT)
-                break;
+    return State;
+}
 
-            // We are waiting for a watch event at DISPATCH_LEVEL so
-            // it is our responsibility to poll the store ring.
-            STORE(Poll,
-                  Frontend->StoreInterface);
+static FORCEINLINE VOID
+__FrontendSwap(
+    IN OUT  PCHAR               *Left,
+    IN OUT  PCHAR               *Right
+    )
+{
+    PCHAR   Temp = *Left;
 
-            KeStallExecutionProcessor(1000);   // 1ms
-        }
+    *Left = *Right;
+    *Right = Temp;
+}
 
-        KeClearEvent(&Event);
+static NTSTATUS
+__FrontendReadPath(
+    IN  PXENHID_FRONTEND            Frontend,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction
+    )
+{
+    PCHAR           Buffer;
+    PCHAR           Path;
+    ULONG           Length;
+    KIRQL           Irql;
+    NTSTATUS        status;
 
-        status = STORE(Read,
-                       Frontend->StoreInterface,
-                       NULL,
-                       Frontend->BackendPath,
-                       "state",
-                       &Buffer);
-        if (!NT_SUCCESS(status))
-            goto fail2;
+    status = STORE(Read, Frontend->StoreInterface, Transaction,
+                    FdoGetStorePath(Frontend->Fdo), "backend", &Buffer);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
-        *State = (XenbusState)strtol(Buffer, NULL, 10);
+    // keep the allocation if the backend has not moved
+    if (Frontend->BackendPath != NULL &&
+        strcmp(Frontend->BackendPath, Buffer) == 0)
+        goto done;
 
-        STORE(Free,
-              Frontend->StoreInterface,
-              Buffer);
+    Length = (ULONG)strlen(Buffer);
+    Path = __FrontendAllocate((Length + 1) * sizeof(CHAR));
 
-        KeQuerySystemTime(&Now);
+    status = STATUS_NO_MEMORY;
+    if (Path == NULL)
+        goto fail2;
 
-        TimeDelta = (Now.QuadPart - Start.QuadPart) / 10000ull;
-    }
+    RtlCopyMemory(Path, Buffer, Length * sizeof(CHAR));
 
-    status = STATUS_UNSUCCESSFUL;
-    if (*State == Old)
-        goto fail3;
+    // Only this thread writes it, but the debug callback reads it too
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    __FrontendSwap(&Frontend->BackendPath, &Path);
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
 
-    (VOID) STORE(Unwatch,
-                 Frontend->StoreInterface,
-                 Watch);
+    if (Path != NULL)
+        __FrontendFree(Path);
 
-    Trace("%s: <==== (%s)\n", Frontend->BackendPath, XenbusStateName(*State));
+done:
+    STORE(Free, Frontend->StoreInterface, Buffer);
 
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail3\n");
-
 fail2:
     Error("fail2\n");
 
-    (VOID) STORE(Unwatch,
-                 Frontend->StoreInterface,
-                 Watch);
+    STORE(Free, Frontend->StoreInterface, Buffer);
 
 fail1:
     Error("fail1 (%08x)\n", status);
-                   
+
     return status;
 }
 
+static FORCEINLINE NTSTATUS
+__FrontendReadValue(
+    IN  PXENHID_FRONTEND            Frontend,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction,
+    IN  PCHAR                       Node,
+    OUT PULONG                      Value
+    )
+{
+    PCHAR           Buffer;
+    NTSTATUS        status;
+
+    status = STORE(Read, Frontend->StoreInterface, Transaction,
+                    FdoGetStorePath(Frontend->Fdo), Node, &Buffer);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    *Value = (ULONG)strtoul(Buffer, NULL, 10);
+    STORE(Free, Frontend->StoreInterface, Buffer);
+
+    return STATUS_SUCCESS;
+}
+
+// Read everything the handshake needs from the frontend area in one
+// transaction. The result is kept until the backend goes away or the
+// frontend is stopped, so re-connecting (e.g. on resume) reads nothing.
 static NTSTATUS
 __FrontendUpdatePaths(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
+    ULONG           Domain;
     NTSTATUS        status;
-    PCHAR           Buffer;
-    ULONG           Length;
 
-    status = STORE(Read, Frontend->StoreInterface, NULL,
-                    FdoGetStorePath(Frontend->Fdo), "backend", &Buffer);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    if (!Frontend->Stale)
+        return STATUS_SUCCESS;
 
-    Length = (ULONG)strlen(Buffer);
-    if (Frontend->BackendPath)
-        __FrontendFree(Frontend->BackendPath);
-    Frontend->BackendPath = __FrontendAllocate((Length + 1) * sizeof(CHAR));
-    if (Frontend->BackendPath == NULL)
-        goto fail2;
+    for (;;) {
+        PXENBUS_STORE_TRANSACTION   Transaction;
 
-    RtlCopyMemory(Frontend->BackendPath, Buffer, Length * sizeof(CHAR));
-    STORE(Free, Frontend->StoreInterface, Buffer);
+        status = STORE(TransactionStart,
+                       Frontend->StoreInterface,
+                       &Transaction);
+        if (!NT_SUCCESS(status))
+            break;
+
+        status = __FrontendReadPath(Frontend, Transaction);
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = __FrontendReadValue(Frontend, Transaction,
+                                     "backend-id", &Domain);
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = STORE(TransactionEnd, Frontend->StoreInterface, Transaction, TRUE);
+        if (status == STATUS_RETRY)
+            continue;
+        break;
 
-    status = STORE(Read, Frontend->StoreInterface, NULL,
-                    FdoGetStorePath(Frontend->Fdo), "backend-id", &Buffer);
+abort:
+        (VOID) STORE(TransactionEnd, Frontend->StoreInterface, Transaction, FALSE);
+        break;
+    }
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail1;
 
-    Frontend->BackendDomain = (USHORT)strtoul(Buffer, NULL, 10);
-    STORE(Free, Frontend->StoreInterface, Buffer);
+    Frontend->BackendDomain = (USHORT)Domain;
+    Frontend->Stale = FALSE;
+    ++Frontend->NumLookups;
 
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail3\n");
-fail2:
-    Error("fail2\n");
 fail1:
     Error("fail1 (%08x)\n", status);
     return status;
 }
 
+static FORCEINLINE VOID
+__FrontendArmTimer(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  ULONG                   Seconds
+    )
+{
+    LARGE_INTEGER   Timeout;
+
+    Timeout.QuadPart = -10000000ll * Seconds;
+    Frontend->Deadline = KeQueryInterruptTime() + (ULONGLONG)-Timeout.QuadPart;
+
+    (VOID) KeSetTimer(&Frontend->Timer, Timeout, NULL);
+}
+
+// Give the backend FRONTEND_HANDSHAKE_TIMEOUT to follow a state change
+static FORCEINLINE VOID
+__FrontendArmTimeout(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    __FrontendArmTimer(Frontend, FRONTEND_HANDSHAKE_TIMEOUT);
+}
+
+static FORCEINLINE BOOLEAN
+__FrontendTimedOut(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    // the timer may have fired for an earlier state
+    return (KeQueryInterruptTime() >= Frontend->Deadline) ? TRUE : FALSE;
+}
+
+// Leave IDLE: watch the backend and start the close half of the handshake
 static NTSTATUS
-__FrontendClose(
+__FrontendStart(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
     NTSTATUS    status;
-    XenbusState State = XenbusStateUnknown;
+
+    STORE(Acquire, Frontend->StoreInterface);
 
     status = __FrontendUpdatePaths(Frontend);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = __FrontendSetState(Frontend, XenbusStateClosing);
+    KeClearEvent(&Frontend->WatchEvent);
+
+    status = STORE(Watch,
+                   Frontend->StoreInterface,
+                   Frontend->BackendPath,
+                   "state",
+                   &Frontend->WatchEvent,
+                   &Frontend->Watch);
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    do {
-        status = __FrontendWaitState(Frontend, &State);
-        if (!NT_SUCCESS(status))
-            goto fail3;
-    } while (State != XenbusStateClosing && State != XenbusStateClosed);
-
-    status = __FrontendSetState(Frontend, XenbusStateClosed);
+    status = __FrontendSetState(Frontend, NULL, XenbusStateClosing);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail3;
 
-    do {
-        status = __FrontendWaitState(Frontend, &State);
-        if (!NT_SUCCESS(status))
-            goto fail5;
-    } while (State != XenbusStateClosed);
+    ++Frontend->NumHandshakes;
+    __FrontendArmTimeout(Frontend);
 
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
-fail4:
-    Error("fail4\n");
 fail3:
     Error("fail3\n");
+
+    (VOID) STORE(Unwatch,
+                 Frontend->StoreInterface,
+                 Frontend->Watch);
+    Frontend->Watch = NULL;
+
 fail2:
     Error("fail2\n");
 fail1:
     Error("fail1 (%08x)\n", status);
+
+    STORE(Release, Frontend->StoreInterface);
+
     return status;
 }
 
-static NTSTATUS
-__FrontendConnect(
+// Back to IDLE (or FAILED): undo __FrontendStart
+static VOID
+__FrontendStop(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
-    NTSTATUS    status;
-    XenbusState State = XenbusStateUnknown;
+    (VOID) KeCancelTimer(&Frontend->Timer);
 
-    status = __FrontendUpdatePaths(Frontend);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    (VOID) STORE(Unwatch,
+                 Frontend->StoreInterface,
+                 Frontend->Watch);
+    Frontend->Watch = NULL;
 
-    status = Frontend->Operations.Connect(Frontend->Context);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    // nothing tells us if the backend moves while we're not watching
+    Frontend->Stale = TRUE;
+
+    STORE(Release, Frontend->StoreInterface);
+}
+
+// Write our end's details and state=Connected together, so the
+// backend sees both or neither
+static NTSTATUS
+__FrontendPublish(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    NTSTATUS    status;
 
     for (;;) {
         PXENBUS_STORE_TRANSACTION   Transaction;
@@ -376,6 +660,10 @@ __FrontendConnect(
         if (!NT_SUCCESS(status))
             goto abort;
 
+        status = __FrontendSetState(Frontend, Transaction, XenbusStateConnected);
+        if (!NT_SUCCESS(status))
+            goto abort;
+
         status = STORE(TransactionEnd, Frontend->StoreInterface, Transaction, TRUE);
         if (status == STATUS_RETRY)
             continue;
@@ -383,127 +671,707 @@ __FrontendConnect(
 
 abort:
         (VOID) STORE(TransactionEnd, Frontend->StoreInterface, Transaction, FALSE);
+        break;
     }
-    if (!NT_SUCCESS(status))
-        goto fail3;
 
-    status = __FrontendSetState(Frontend, XenbusStateConnected);
-    if (!NT_SUCCESS(status))
-        goto fail4;
+    return status;
+}
 
-    status = __FrontendWaitState(Frontend, &State);
-    if (!NT_SUCCESS(status))
-        goto fail5;
+// The backend has closed: set up our end and tell it we're connected
+// No protocol's report descriptor is larger than this
+#define FRONTEND_MAX_DESCRIPTOR_LENGTH  PAGE_SIZE
 
-    status = STATUS_INVALID_PARAMETER;
-    if (State != XenbusStateConnected)
-        goto fail6;
-    
-    return STATUS_SUCCESS;
+// hidclass parsed the report descriptor when the device started and
+// will not ask again, so a backend that comes back with a different one
+// (a different device behind the same node) cannot be connected: its
+// reports would be read against the old layout.
+static NTSTATUS
+__FrontendCheckDescriptor(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    PUCHAR      Buffer;
+    ULONG_PTR   Length;
+    KIRQL       Irql;
+    BOOLEAN     Changed;
+    NTSTATUS    status;
+
+    if (Frontend->ReportDescriptor == NULL)
+        return STATUS_SUCCESS;
+
+    status = STATUS_NO_MEMORY;
+    Buffer = __FrontendAllocate(FRONTEND_MAX_DESCRIPTOR_LENGTH);
+    if (Buffer == NULL)
+        goto fail1;
+
+    Length = 0;
+    status = Frontend->Operations.GetReportDescriptor(Frontend->Context,
+                                                      Buffer,
+                                                      FRONTEND_MAX_DESCRIPTOR_LENGTH,
+                                                      &Length);
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    Changed = (!NT_SUCCESS(status) ||
+               Length != Frontend->ReportDescriptorLength ||
+               RtlCompareMemory(Buffer,
+                                Frontend->ReportDescriptor,
+                                Length) != Length) ? TRUE : FALSE;
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    __FrontendFree(Buffer);
+
+    status = STATUS_REVISION_MISMATCH;
+    if (Changed)
+        goto fail2;
+
+    return STATUS_SUCCESS;
 
-fail6:
-    Error("fail6\n");
-fail5:
-    Error("fail5\n");
-fail4:
-    Error("fail4\n");
-fail3:
-    Error("fail3\n");
-    Frontend->Operations.Disconnect(Frontend->Context);
 fail2:
-    Error("fail2\n");
+    Error("fail2: report descriptor changed (%u bytes, was %u); the device must be re-added\n",
+          (ULONG)Length,
+          Frontend->ReportDescriptorLength);
 fail1:
     Error("fail1 (%08x)\n", status);
     return status;
 }
 
-NTSTATUS
-FrontendEnable(
+// Keep what hidclass was given, to check later connections against
+static VOID
+__FrontendKeepDescriptor(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  PVOID                   Buffer,
+    IN  ULONG                   Length
+    )
+{
+    PUCHAR      Copy;
+    KIRQL       Irql;
+
+    if (Length == 0)
+        return;
+
+    Copy = __FrontendAllocate(Length);
+    if (Copy == NULL)
+        return;
+
+    RtlCopyMemory(Copy, Buffer, Length);
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    Buffer = Frontend->ReportDescriptor;
+    Frontend->ReportDescriptor = Copy;
+    Frontend->ReportDescriptorLength = Length;
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    if (Buffer)
+        __FrontendFree(Buffer);
+}
+
+// hidclass writes an output report (the keyboard LEDs) when its state
+// changes, not when we reconnect, and each connection has a protocol
+// context of its own. So the last one written is kept here and handed
+// to every new context, and to the protocol once it can take calls if
+// one arrived while it could not. Called under Lock, which also keeps
+// a replay from overtaking a newer write.
+static VOID
+__FrontendReplayOutput(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
-    PCHAR       Buffer;
-    ULONG       Protocol;
-    NTSTATUS    status;
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
-    ASSERT(Frontend->Connected == FALSE);
+    Frontend->OutputPending = FALSE;
 
-    STORE(Acquire, Frontend->StoreInterface);
+    if (Frontend->OutputReportLength == 0)
+        return;
+
+    (VOID) Frontend->Operations.WriteReport(Frontend->Context,
+                                            Frontend->OutputReport,
+                                            Frontend->OutputReportLength);
+}
 
-    status = __FrontendClose(Frontend);
+static NTSTATUS
+__FrontendConnect(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    KIRQL       Irql;
+    NTSTATUS    status;
+
+    status = Frontend->Operations.Create(Frontend, &Frontend->Context);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = STORE(Read, 
-                    Frontend->StoreInterface, 
-                    NULL, 
-                    FdoGetStorePath(Frontend->Fdo),
-                    "protocol",
-                    &Buffer);
-    if (NT_SUCCESS(status)) {
-        Protocol = (ULONG)strtoul(Buffer, NULL, 10);
-        STORE(Free, Frontend->StoreInterface, Buffer);
-    } else {
-        Protocol = 0;
-    }
-    switch (Protocol) {
-    case 0:
-        // VKBD
-        status = VkbdInitialize(&Frontend->Operations);
-        break;
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    __FrontendReplayOutput(Frontend);
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
 
-    default:
-        status = STATUS_INVALID_PARAMETER;
-        break;
-    }
+    status = Frontend->Operations.Connect(Frontend->Context);
     if (!NT_SUCCESS(status))
         goto fail2;
-    
-    status = Frontend->Operations.Create(Frontend, &Frontend->Context);
+
+    status = __FrontendCheckDescriptor(Frontend);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    status = __FrontendConnect(Frontend);
+    status = __FrontendPublish(Frontend);
     if (!NT_SUCCESS(status))
         goto fail4;
 
-    Frontend->Connected = TRUE;
+    __FrontendArmTimeout(Frontend);
+
     return STATUS_SUCCESS;
 
 fail4:
     Error("fail4\n");
-    Frontend->Operations.Destroy(Frontend->Context);
-    Frontend->Context = NULL;
 fail3:
     Error("fail3\n");
-    RtlZeroMemory(&Frontend->Operations, sizeof(XENHID_OPERATIONS));
+    Frontend->Operations.Disconnect(Frontend->Context);
 fail2:
     Error("fail2\n");
+    Frontend->Operations.Destroy(Frontend->Context);
+    Frontend->Context = NULL;
 fail1:
     Error("fail1 (%08x)\n", status);
-    STORE(Release, Frontend->StoreInterface);
     return status;
 }
 
-VOID
-FrontendDisable(
+static VOID
+__FrontendDisconnect(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
-    ASSERT(Frontend->Connected == TRUE);
+    // wait for any call into the protocol to return first
+    if (Frontend->Connected) {
+        Frontend->Connected = FALSE;
+        ExWaitForRundownProtectionRelease(&Frontend->Rundown);
+    }
 
     Frontend->Operations.Disconnect(Frontend->Context);
     
     Frontend->Operations.Destroy(Frontend->Context);
     Frontend->Context = NULL;
-    
-    RtlZeroMemory(&Frontend->Operations, sizeof(XENHID_OPERATIONS));
+}
 
-    (VOID) __FrontendClose(Frontend);
+// Nothing is set up: try again from the start once the backoff is up.
+// The thread sleeps until then, unless a new request comes in.
+static VOID
+__FrontendRetry(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  NTSTATUS                status
+    )
+{
+    Frontend->Status = status;
+    Frontend->State = FRONTEND_FAILED;
 
-    STORE(Release, Frontend->StoreInterface);
+    __FrontendArmTimer(Frontend, Frontend->Backoff);
+    Frontend->Backoff = min(Frontend->Backoff * 2, FRONTEND_BACKOFF_MAX);
+}
 
-    Frontend->Connected = FALSE;
+static VOID
+__FrontendFail(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  NTSTATUS                status
+    )
+{
+    Error("%s: failed in %s (%08x)\n",
+          Frontend->BackendPath,
+          __FrontendStateName(Frontend->State),
+          status);
+
+    __FrontendStop(Frontend);
+    __FrontendRetry(Frontend, status);
+}
+
+// Tear down our end and start closing again
+static VOID
+__FrontendClose(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    NTSTATUS    status;
+
+    __FrontendDisconnect(Frontend);
+
+    status = __FrontendSetState(Frontend, NULL, XenbusStateClosing);
+    if (!NT_SUCCESS(status)) {
+        __FrontendFail(Frontend, status);
+        return;
+    }
+
+    __FrontendArmTimeout(Frontend);
+    Frontend->State = FRONTEND_CLOSING;
+}
+
+// Suspend/resume: the backend is new but everything on our side can
+// stay, so skip the close and go straight to connecting. Reads keep
+// flowing to the protocol throughout.
+static NTSTATUS
+__FrontendResume(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    NTSTATUS    status;
+
+    ++Frontend->NumResumes;
+
+    status = Frontend->Operations.Resume(Frontend->Context);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = __FrontendPublish(Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    __FrontendArmTimeout(Frontend);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+
+// The backend is closing, or no longer there at all
+static FORCEINLINE BOOLEAN
+__FrontendBackendGone(
+    IN  XenbusState             State
+    )
+{
+    return (State == XenbusStateClosing ||
+            State == XenbusStateClosed ||
+            State == XenbusStateUnknown) ? TRUE : FALSE;
+}
+
+// Take the machine as far as it can go without waiting for the backend
+static VOID
+__FrontendRun(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  BOOLEAN                 Timer
+    )
+{
+    KIRQL           Irql;
+    BOOLEAN         Enabled;
+    BOOLEAN         Reset;
+    BOOLEAN         Resume;
+    BOOLEAN         TimedOut;
+    FRONTEND_STATE  State;
+    BOOLEAN         Read;
+    FRONTEND_STATE  Observed;
+    XenbusState     Seen;
+    XenbusState     Backend;
+    NTSTATUS        status;
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    Enabled = Frontend->Enabled;
+    Reset = Frontend->Reset;
+    Frontend->Reset = FALSE;
+    Resume = Frontend->Resume;
+    Frontend->Resume = FALSE;
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    // Only a connection can be resumed; a handshake part way through
+    // was with the old backend, so start it again
+    if (Resume && !Reset && Frontend->State != FRONTEND_CONNECTED) {
+        Reset = TRUE;
+        Resume = FALSE;
+    }
+
+    TimedOut = Timer && __FrontendTimedOut(Frontend);
+
+    // The backend state is read at most once per wake-up: anything
+    // that changes it afterwards fires the watch and wakes us again
+    Read = FALSE;
+    Observed = FRONTEND_IDLE;
+    Seen = XenbusStateUnknown;
+
+    do {
+        State = Frontend->State;
+
+        if (!Read &&
+            (State == FRONTEND_CLOSING ||
+             State == FRONTEND_CLOSED ||
+             State == FRONTEND_CONNECTING ||
+             State == FRONTEND_CONNECTED)) {
+            Seen = __FrontendGetBackendState(Frontend);
+            Observed = State;
+            Read = TRUE;
+        }
+
+        // Once connecting, a backend state read before we published
+        // our end says nothing about what the backend made of it
+        Backend = Seen;
+        if ((State == FRONTEND_CONNECTING || State == FRONTEND_CONNECTED) &&
+            Observed != State)
+            Backend = XenbusStateInitWait;
+
+        Trace("%s: %s (backend %s)%s%s%s\n",
+              Frontend->BackendPath,
+              __FrontendStateName(State),
+              XenbusStateName(Backend),
+              Enabled ? " ENABLED" : "",
+              Reset ? " RESET" : (Resume ? " RESUME" : ""),
+              TimedOut ? " TIMEOUT" : "");
+
+        switch (State) {
+        case FRONTEND_IDLE:
+            if (!Enabled)
+                break;
+
+            status = __FrontendStart(Frontend);
+            if (!NT_SUCCESS(status)) {
+                __FrontendRetry(Frontend, status);
+                break;
+            }
+            Frontend->State = FRONTEND_CLOSING;
+            break;
+
+        // A backend that has been restarted waits in InitWait rather
+        // than Closed, and has nothing left to close
+        case FRONTEND_CLOSING:
+            if (Backend == XenbusStateClosing ||
+                Backend == XenbusStateClosed ||
+                Backend == XenbusStateInitWait) {
+                status = __FrontendSetState(Frontend, NULL, XenbusStateClosed);
+                if (!NT_SUCCESS(status)) {
+                    __FrontendFail(Frontend, status);
+                    break;
+                }
+                __FrontendArmTimeout(Frontend);
+                Frontend->State = FRONTEND_CLOSED;
+            } else if (TimedOut) {
+                ++Frontend->NumTimeouts;
+                __FrontendFail(Frontend, STATUS_IO_TIMEOUT);
+            }
+            break;
+
+        case FRONTEND_CLOSED:
+            if (Backend == XenbusStateClosed ||
+                Backend == XenbusStateInitWait) {
+                if (!Enabled) {
+                    __FrontendStop(Frontend);
+                    Frontend->State = FRONTEND_IDLE;
+                    break;
+                }
+
+                status = __FrontendConnect(Frontend);
+                if (!NT_SUCCESS(status)) {
+                    __FrontendFail(Frontend, status);
+                    break;
+                }
+                Frontend->State = FRONTEND_CONNECTING;
+            } else if (TimedOut) {
+                ++Frontend->NumTimeouts;
+                __FrontendFail(Frontend, STATUS_IO_TIMEOUT);
+            }
+            break;
+
+        case FRONTEND_CONNECTING:
+            if (!Enabled || Reset) {
+                __FrontendClose(Frontend);
+            } else if (Backend == XenbusStateConnected) {
+                (VOID) KeCancelTimer(&Frontend->Timer);
+
+                // still connected if this was a resume
+                if (!Frontend->Connected) {
+                    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+                    ExReInitializeRundownProtection(&Frontend->Rundown);
+                    Frontend->Connected = TRUE;
+
+                    // anything written since the context was created
+                    if (Frontend->OutputPending)
+                        __FrontendReplayOutput(Frontend);
+                    KeReleaseSpinLock(&Frontend->Lock, Irql);
+                }
+                Frontend->Status = STATUS_SUCCESS;
+                Frontend->Backoff = FRONTEND_BACKOFF_MIN;
+                Frontend->State = FRONTEND_CONNECTED;
+            } else if (__FrontendBackendGone(Backend)) {
+                ++Frontend->NumReconnects;
+                __FrontendClose(Frontend);
+            } else if (TimedOut) {
+                ++Frontend->NumTimeouts;
+                __FrontendDisconnect(Frontend);
+                __FrontendFail(Frontend, STATUS_IO_TIMEOUT);
+            }
+            break;
+
+        case FRONTEND_CONNECTED:
+            if (!Enabled || Reset) {
+                __FrontendClose(Frontend);
+            } else if (__FrontendBackendGone(Backend)) {
+                // e.g. the backend has been restarted: the device
+                // stays started, and reads queue, while we reconnect
+                Warning("%s: backend %s\n",
+                        Frontend->BackendPath,
+                        XenbusStateName(Backend));
+                ++Frontend->NumReconnects;
+                __FrontendClose(Frontend);
+            } else if (Resume) {
+                status = __FrontendResume(Frontend);
+                if (!NT_SUCCESS(status)) {
+                    // fall back to the full handshake
+                    __FrontendClose(Frontend);
+                    break;
+                }
+                Frontend->State = FRONTEND_CONNECTING;
+            }
+            break;
+
+        case FRONTEND_FAILED:
+            if (!Enabled || Reset) {
+                // a new request starts a new backoff
+                (VOID) KeCancelTimer(&Frontend->Timer);
+                Frontend->Backoff = FRONTEND_BACKOFF_MIN;
+                Frontend->State = FRONTEND_IDLE;
+            } else if (TimedOut) {
+                ++Frontend->NumRetries;
+                Frontend->State = FRONTEND_IDLE;
+            }
+            break;
+
+        default:
+            ASSERT(FALSE);
+            break;
+        }
+
+        // each of these applies to the state it was seen in
+        TimedOut = FALSE;
+        Reset = FALSE;
+        Resume = FALSE;
+    } while (Frontend->State != State);
+
+    // Let FrontendWait() go if this is what was asked for, and it
+    // hasn't been asked for something else in the meantime
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    if (Frontend->Enabled == Enabled && !Frontend->Reset) {
+        switch (Frontend->State) {
+        case FRONTEND_IDLE:
+            if (!Enabled) {
+                Frontend->Status = STATUS_SUCCESS;
+                KeSetEvent(&Frontend->Settled, IO_NO_INCREMENT, FALSE);
+            }
+            break;
+
+        case FRONTEND_CONNECTED:
+        case FRONTEND_FAILED:
+            if (Enabled)
+                KeSetEvent(&Frontend->Settled, IO_NO_INCREMENT, FALSE);
+            break;
+
+        default:
+            break;
+        }
+    }
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+}
+
+VOID
+FrontendThread(
+    IN  PVOID                   Context
+    )
+{
+    PXENHID_FRONTEND    Frontend = Context;
+    PVOID               Object[3];
+    NTSTATUS            status;
+
+    Trace("====>\n");
+
+    Object[0] = &Frontend->Event;
+    Object[1] = &Frontend->WatchEvent;
+    Object[2] = &Frontend->Timer;
+
+    for (;;) {
+        status = KeWaitForMultipleObjects(ARRAYSIZE(Object),
+                                          Object,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          NULL,
+                                          NULL);
+
+        if (Frontend->Stop)
+            break;
+
+        KeClearEvent(&Frontend->WatchEvent);
+
+        __FrontendRun(Frontend, (status == STATUS_WAIT_2) ? TRUE : FALSE);
+    }
+
+    Trace("<====\n");
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static VOID
+__FrontendRequest(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  BOOLEAN                 Enabled
+    )
+{
+    KIRQL   Irql;
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    Frontend->Enabled = Enabled;
+    Frontend->Reset = TRUE;
+    KeClearEvent(&Frontend->Settled);
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    KeSetEvent(&Frontend->Event, IO_NO_INCREMENT, FALSE);
+}
+
+// Callable at DISPATCH_LEVEL: the handshake is carried out by the
+// frontend thread. Use FrontendWait() to find out how it went.
+NTSTATUS
+FrontendEnable(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    __FrontendRequest(Frontend, TRUE);
+    return STATUS_SUCCESS;
+}
+
+// Any existing connection is dropped, even if re-enabled before the
+// thread gets to it (e.g. across suspend and resume)
+VOID
+FrontendDisable(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    __FrontendRequest(Frontend, FALSE);
+}
+
+// Called from the (late) suspend callback, at DISPATCH_LEVEL
+VOID
+FrontendResume(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    KIRQL   Irql;
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    Frontend->Resume = TRUE;
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    KeSetEvent(&Frontend->Event, IO_NO_INCREMENT, FALSE);
+}
+
+// Wait for the last request to be carried out: connected (or failed)
+// once enabled, closed once disabled
+NTSTATUS
+FrontendWait(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    LARGE_INTEGER   Timeout;
+    NTSTATUS        status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    // every state the thread waits in has its own timeout
+    Timeout.QuadPart = -10000000ll * FRONTEND_HANDSHAKE_TIMEOUT * 4;
+
+    status = KeWaitForSingleObject(&Frontend->Settled,
+                                   Executive,
+                                   KernelMode,
+                                   FALSE,
+                                   &Timeout);
+    if (status == STATUS_TIMEOUT)
+        return STATUS_IO_TIMEOUT;
+
+    return Frontend->Status;
+}
+
+// Calls into the protocol are made under rundown protection, which
+// __FrontendDisconnect() waits out before tearing the protocol down
+static FORCEINLINE BOOLEAN
+__FrontendAcquire(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    return ExAcquireRundownProtection(&Frontend->Rundown);
+}
+
+static FORCEINLINE VOID
+__FrontendRelease(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    ExReleaseRundownProtection(&Frontend->Rundown);
+}
+
+// hidclass asks for the attributes and descriptors as soon as start
+// completes, which is usually before the handshake has finished. A
+// protocol that can answer without a connection (VKBD's are fixed) is
+// asked with a NULL context; one that can't (raw HID gets them from the
+// backend) fails that with STATUS_DEVICE_NOT_READY, and only then is
+// the request held until the handshake settles.
+static FORCEINLINE BOOLEAN
+__FrontendAcquireDescriptor(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  NTSTATUS                status
+    )
+{
+    if (status != STATUS_DEVICE_NOT_READY ||
+        KeGetCurrentIrql() != PASSIVE_LEVEL)
+        return FALSE;
+
+    (VOID) FrontendWait(Frontend);
+
+    return __FrontendAcquire(Frontend);
+}
+
+VOID
+FrontendDebugCallback(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  PXENBUS_DEBUG_INTERFACE DebugInterface,
+    IN  PXENBUS_DEBUG_CALLBACK  DebugCallback
+    )
+{
+    KIRQL   Irql;
+
+    // may be called at high IRQL if crashing; skip what needs locks
+    if (KeGetCurrentIrql() <= DISPATCH_LEVEL) {
+        KeAcquireSpinLock(&Frontend->Lock, &Irql);
+        DEBUG(Printf,
+              DebugInterface,
+              DebugCallback,
+              "%s: %s\n",
+              Frontend->BackendPath,
+              Frontend->Connected ? "CONNECTED" : "DISCONNECTED");
+        KeReleaseSpinLock(&Frontend->Lock, Irql);
+    }
+
+    DEBUG(Printf,
+          DebugInterface,
+          DebugCallback,
+          "State: %s%s Handshakes: %u Resumes: %u Timeouts: %u Lookups: %u\n",
+          __FrontendStateName(Frontend->State),
+          Frontend->Enabled ? "" : " (DISABLED)",
+          Frontend->NumHandshakes,
+          Frontend->NumResumes,
+          Frontend->NumTimeouts,
+          Frontend->NumLookups);
+
+    DEBUG(Printf,
+          DebugInterface,
+          DebugCallback,
+          "Reconnects: %u Retries: %u Backoff: %us\n",
+          Frontend->NumReconnects,
+          Frontend->NumRetries,
+          Frontend->Backoff);
+
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL ||
+        !__FrontendAcquire(Frontend))
+        return;
+
+    ASSERT3P(Frontend->Context, !=, NULL);
+
+    Frontend->Operations.DebugCallback(Frontend->Context, DebugInterface, DebugCallback);
+
+    __FrontendRelease(Frontend);
 }
 
 NTSTATUS
@@ -514,12 +1382,21 @@ FrontendGetDeviceAttributes(
     OUT PULONG_PTR              Information
     )
 {
-    if (!Frontend->Connected)
-        return STATUS_DEVICE_NOT_READY;
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend)) {
+        status = Frontend->Operations.GetDeviceAttributes(NULL, Buffer, Length, Information);
+        if (!__FrontendAcquireDescriptor(Frontend, status))
+            return status;
+    }
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.GetDeviceAttributes(Frontend->Context, Buffer, Length, Information);
+    status = Frontend->Operations.GetDeviceAttributes(Frontend->Context, Buffer, Length, Information);
+
+    __FrontendRelease(Frontend);
+
+    return status;
 }
 
 NTSTATUS
@@ -530,12 +1407,21 @@ FrontendGetDeviceDescriptor(
     OUT PULONG_PTR              Information
     )
 {
-    if (!Frontend->Connected)
-        return STATUS_DEVICE_NOT_READY;
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend)) {
+        status = Frontend->Operations.GetDeviceDescriptor(NULL, Buffer, Length, Information);
+        if (!__FrontendAcquireDescriptor(Frontend, status))
+            return status;
+    }
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.GetDeviceDescriptor(Frontend->Context, Buffer, Length, Information);
+    status = Frontend->Operations.GetDeviceDescriptor(Frontend->Context, Buffer, Length, Information);
+
+    __FrontendRelease(Frontend);
+
+    return status;
 }
 
 NTSTATUS
@@ -546,12 +1432,25 @@ FrontendGetReportDescriptor(
     OUT PULONG_PTR              Information
     )
 {
-    if (!Frontend->Connected)
-        return STATUS_DEVICE_NOT_READY;
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend)) {
+        status = Frontend->Operations.GetReportDescriptor(NULL, Buffer, Length, Information);
+        if (!__FrontendAcquireDescriptor(Frontend, status))
+            goto done;
+    }
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.GetReportDescriptor(Frontend->Context, Buffer, Length, Information);
+    status = Frontend->Operations.GetReportDescriptor(Frontend->Context, Buffer, Length, Information);
+
+    __FrontendRelease(Frontend);
+
+done:
+    if (NT_SUCCESS(status))
+        __FrontendKeepDescriptor(Frontend, Buffer, (ULONG)*Information);
+
+    return status;
 }
 
 NTSTATUS
@@ -562,12 +1461,18 @@ FrontendGetFeature(
     OUT PULONG_PTR              Information
     )
 {
-    if (!Frontend->Connected)
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend))
         return STATUS_DEVICE_NOT_READY;
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.GetFeature(Frontend->Context, Buffer, Length, Information);
+    status = Frontend->Operations.GetFeature(Frontend->Context, Buffer, Length, Information);
+
+    __FrontendRelease(Frontend);
+
+    return status;
 }
 
 NTSTATUS
@@ -577,12 +1482,41 @@ FrontendSetFeature(
     IN  ULONG                   Length
     )
 {
-    if (!Frontend->Connected)
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend))
+        return STATUS_DEVICE_NOT_READY;
+
+    ASSERT3P(Frontend->Context, !=, NULL);
+
+    status = Frontend->Operations.SetFeature(Frontend->Context, Buffer, Length);
+
+    __FrontendRelease(Frontend);
+
+    return status;
+}
+
+NTSTATUS
+FrontendGetInputReport(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  UCHAR                   ReportId,
+    IN  PVOID                   Buffer,
+    IN  ULONG                   Length,
+    OUT PULONG_PTR              Information
+    )
+{
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend))
         return STATUS_DEVICE_NOT_READY;
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.SetFeature(Frontend->Context, Buffer, Length);
+    status = Frontend->Operations.GetInputReport(Frontend->Context, ReportId, Buffer, Length, Information);
+
+    __FrontendRelease(Frontend);
+
+    return status;
 }
 
 NTSTATUS
@@ -592,12 +1526,33 @@ FrontendWriteReport(
     IN  ULONG                   Length
     )
 {
-    if (!Frontend->Connected)
-        return STATUS_DEVICE_NOT_READY;
+    KIRQL       Irql;
+    NTSTATUS    status;
+
+    // kept for the next connection whether or not this one takes it
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+
+    if (Length <= FRONTEND_MAX_OUTPUT_REPORT) {
+        RtlCopyMemory(Frontend->OutputReport, Buffer, Length);
+        Frontend->OutputReportLength = Length;
+    }
+
+    status = STATUS_DEVICE_NOT_READY;
+    if (!__FrontendAcquire(Frontend)) {
+        Frontend->OutputPending = TRUE;
+        goto done;
+    }
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.WriteReport(Frontend->Context, Buffer, Length);
+    status = Frontend->Operations.WriteReport(Frontend->Context, Buffer, Length);
+
+    __FrontendRelease(Frontend);
+
+done:
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    return status;
 }
 
 NTSTATUS
@@ -605,12 +1560,18 @@ FrontendReadReport(
     IN  PXENHID_FRONTEND        Frontend
     )
 {
-    if (!Frontend->Connected)
+    NTSTATUS    status;
+
+    if (!__FrontendAcquire(Frontend))
         return STATUS_DEVICE_NOT_READY;
 
     ASSERT3P(Frontend->Context, !=, NULL);
 
-    return Frontend->Operations.ReadReport(Frontend->Context);
+    status = Frontend->Operations.ReadReport(Frontend->Context);
+
+    __FrontendRelease(Frontend);
+
+    return status;
 }
 
 NTSTATUS
@@ -638,3 +1599,11 @@ FrontendGetBackendDomain(
 {
     return Frontend->BackendDomain;
 }
+
+PCHAR
+FrontendGetBackendPath(
+    IN  PXENHID_FRONTEND        Frontend
+    )
+{
+    return Frontend->BackendPath;
+}
@@ -35,6 +35,7 @@
 typedef struct _XENHID_FRONTEND     XENHID_FRONTEND, *PXENHID_FRONTEND;
 
 #include "driver.h"
+#include <debug_interface.h>
 
 extern NTSTATUS
 FrontendCreate(
@@ -57,6 +58,23 @@ FrontendDisable(
     IN  PXENHID_FRONTEND        Frontend
     );
 
+extern VOID
+FrontendResume(
+    IN  PXENHID_FRONTEND        Frontend
+    );
+
+extern NTSTATUS
+FrontendWait(
+    IN  PXENHID_FRONTEND        Frontend
+    );
+
+extern VOID
+FrontendDebugCallback(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  PXENBUS_DEBUG_INTERFACE DebugInterface,
+    IN  PXENBUS_DEBUG_CALLBACK  DebugCallback
+    );
+
 extern NTSTATUS
 FrontendGetDeviceAttributes(
     IN  PXENHID_FRONTEND        Frontend,
@@ -96,6 +114,15 @@ FrontendSetFeature(
     IN  ULONG                   Length
     );
 
+extern NTSTATUS
+FrontendGetInputReport(
+    IN  PXENHID_FRONTEND        Frontend,
+    IN  UCHAR                   ReportId,
+    IN  PVOID                   Buffer,
+    IN  ULONG                   Length,
+    OUT PULONG_PTR              Information
+    );
+
 extern NTSTATUS
 FrontendWriteReport(
     IN  PXENHID_FRONTEND        Frontend,
@@ -125,4 +152,9 @@ FrontendGetBackendDomain(
     IN  PXENHID_FRONTEND        Frontend
     );
 
+extern PCHAR
+FrontendGetBackendPath(
+    IN  PXENHID_FRONTEND        Frontend
+    );
+
 #endif  // _XENHID_FRONTEND_H
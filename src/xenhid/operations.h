@@ -45,16 +45,20 @@ typedef struct _XENHID_OPERATIONS {
     VOID        (*Destroy)(PXENHID_CONTEXT);
 
     NTSTATUS    (*Connect)(PXENHID_CONTEXT);
+    NTSTATUS    (*Resume)(PXENHID_CONTEXT);
     NTSTATUS    (*WriteStore)(PXENHID_CONTEXT, PXENBUS_STORE_TRANSACTION);
     VOID        (*Disconnect)(PXENHID_CONTEXT);
     VOID        (*DebugCallback)(PXENHID_CONTEXT, PXENBUS_DEBUG_INTERFACE, PXENBUS_DEBUG_CALLBACK);
 
-    // HID operations
+    // HID operations. The first three may be called with a NULL context
+    // before the first connection, and fail with STATUS_DEVICE_NOT_READY
+    // if they need the backend to answer.
     NTSTATUS    (*GetDeviceAttributes)(PXENHID_CONTEXT, PVOID, ULONG, PULONG_PTR);
     NTSTATUS    (*GetDeviceDescriptor)(PXENHID_CONTEXT, PVOID, ULONG, PULONG_PTR);
     NTSTATUS    (*GetReportDescriptor)(PXENHID_CONTEXT, PVOID, ULONG, PULONG_PTR);
     NTSTATUS    (*GetFeature)(PXENHID_CONTEXT, PVOID, ULONG, PULONG_PTR);
     NTSTATUS    (*SetFeature)(PXENHID_CONTEXT, PVOID, ULONG);
+    NTSTATUS    (*GetInputReport)(PXENHID_CONTEXT, UCHAR, PVOID, ULONG, PULONG_PTR);
     NTSTATUS    (*WriteReport)(PXENHID_CONTEXT, PVOID, ULONG);
     NTSTATUS    (*ReadReport)(PXENHID_CONTEXT);
 } XENHID_OPERATIONS, *PXENHID_OPERATIONS;
@@ -0,0 +1,1105 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include "rawhid.h"
+#include "operations.h"
+#include "frontend.h"
+#include "fdo.h"
+#include <store_interface.h>
+#include <evtchn_interface.h>
+#include <gnttab_interface.h>
+#include <hidport.h>
+#include <xen.h>
+#include <stdlib.h>
+#include "dbg_print.h"
+#include "assert.h"
+
+// Protocol 1: the backend forwards a real HID device. It supplies the
+// report descriptor (and device identity) in its xenstore area and
+// pushes fully formed input reports through the in-ring of the usual
+// xenkbd_page, which are handed to hidclass as they are.
+
+#define RAWHID_TYPE_REPORT          0x80    // clear of the XENKBD_TYPE_* values
+
+#define RAWHID_MAX_REPORT_LENGTH    (XENKBD_IN_EVENT_SIZE - 2)
+
+struct rawhid_report {
+    uint8_t type;           // RAWHID_TYPE_REPORT
+    uint8_t length;         // bytes of data, including any report ID
+    uint8_t data[RAWHID_MAX_REPORT_LENGTH];
+};
+
+#define RAWHID_MAX_DESCRIPTOR_LENGTH    4096
+
+typedef struct _XENHID_RAWHID {
+    PXENHID_FRONTEND            Frontend;
+    BOOLEAN                     Connected;
+    KSPIN_LOCK                  Lock;
+    KDPC                        Dpc;
+
+    struct xenkbd_page*         Shared;
+    PXENBUS_EVTCHN_DESCRIPTOR   Evtchn;
+    ULONG                       GrantRef;
+
+    HID_DEVICE_ATTRIBUTES       DeviceAttributes;
+    HID_DESCRIPTOR              DeviceDescriptor;
+    PUCHAR                      ReportDescriptor;
+    ULONG                       ReportDescriptorLength;
+
+    BOOLEAN                     Stalled;
+    ULONG                       EventBudget;
+    ULONGLONG                   TimeBudget;
+
+    ULONG                       NumInts;
+    ULONG                       NumEvts;
+    ULONG                       NumReports;
+    ULONG                       NumStalls;
+    ULONG                       NumInvalid;
+    ULONG                       NumOversized;
+    ULONG                       NumExhausted;
+    ULONG                       NumOverruns;
+    ULONG                       NumDropped;
+} XENHID_RAWHID, *PXENHID_RAWHID;
+
+#define RAWHID_POOL_TAG     'DIHR'
+
+static FORCEINLINE PVOID
+__RawHidAllocate(
+    IN  ULONG               Length
+    )
+{
+    PVOID   Buffer;
+
+    Buffer = ExAllocatePoolWithTag(NonPagedPool, Length, RAWHID_POOL_TAG);
+    if (Buffer)
+        RtlZeroMemory(Buffer, Length);
+
+    return Buffer;
+}
+
+static FORCEINLINE VOID
+__RawHidFree(
+    IN  PVOID               Buffer
+    )
+{
+    if (Buffer)
+        ExFreePoolWithTag(Buffer, RAWHID_POOL_TAG);
+}
+
+static FORCEINLINE PFN_NUMBER
+__Pfn(
+    IN  PVOID               Buffer
+    )
+{
+    return (PFN_NUMBER)(ULONG_PTR)(MmGetPhysicalAddress(Buffer).QuadPart >> PAGE_SHIFT);
+}
+
+// Sampling the clock is not free, so only do it every few reports
+#define RAWHID_TIME_CHECK_INTERVAL  16
+
+static FORCEINLINE BOOLEAN
+__RawHidOverBudget(
+    IN  PXENHID_RAWHID      RawHid,
+    IN  ULONG               Count,
+    IN  ULONGLONG           Start
+    )
+{
+    if (RawHid->EventBudget != 0 && Count >= RawHid->EventBudget)
+        return TRUE;
+
+    if (RawHid->TimeBudget != 0 &&
+        (Count % RAWHID_TIME_CHECK_INTERVAL) == 0 &&
+        (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart - Start >= RawHid->TimeBudget)
+        return TRUE;
+
+    return FALSE;
+}
+
+static VOID
+RawHidPoll(
+    IN  PXENHID_RAWHID      RawHid,
+    OUT PBOOLEAN            Exhausted
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+    ULONG           Count = 0;
+    ULONGLONG       Start;
+
+    RawHid->Stalled = FALSE;
+    *Exhausted = FALSE;
+    Start = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    for (;;) {
+        ULONG   Cons;
+        ULONG   Prod;
+
+        if (Count != 0 && __RawHidOverBudget(RawHid, Count, Start)) {
+            *Exhausted = TRUE;
+            break;
+        }
+
+        KeMemoryBarrier();
+
+        Cons = RawHid->Shared->in_cons;
+        Prod = RawHid->Shared->in_prod;
+
+        KeMemoryBarrier();
+
+        if (Cons == Prod)
+            break;
+
+        if (Prod - Cons > XENKBD_IN_RING_LEN) {
+            ++RawHid->NumOverruns;
+            RawHid->NumDropped += Prod - Cons;
+
+            Warning("overrun: cons %u prod %u\n", Cons, Prod);
+
+            KeMemoryBarrier();
+
+            RawHid->Shared->in_cons = Prod;
+
+            // charged against the budget, like a report
+            ++Count;
+            continue;
+        }
+
+        while (Cons != Prod) {
+            struct rawhid_report*   Report;
+            NTSTATUS                status;
+
+            Report = (struct rawhid_report*)&XENKBD_IN_RING_REF(RawHid->Shared, Cons);
+
+            if (Report->type != RAWHID_TYPE_REPORT ||
+                Report->length == 0) {
+                ++RawHid->NumInvalid;
+                ++Cons;
+                ++Count;
+                continue;
+            }
+
+            // the backend has a report it cannot forward whole, which
+            // is worth more than a counter
+            if (Report->length > RAWHID_MAX_REPORT_LENGTH) {
+                if (RawHid->NumOversized++ == 0)
+                    Error("%u byte report dropped (at most %u fit in a slot)\n",
+                          Report->length,
+                          RAWHID_MAX_REPORT_LENGTH);
+                ++Cons;
+                ++Count;
+                continue;
+            }
+
+            // Reports can't be merged, so one that can't be delivered
+            // stays on the ring until hidclass posts another read
+            status = FdoCompleteRead(Fdo, Report->data, Report->length);
+            if (!NT_SUCCESS(status)) {
+                if (!RawHid->Stalled)
+                    ++RawHid->NumStalls;
+                RawHid->Stalled = TRUE;
+                break;
+            }
+
+            ++RawHid->NumReports;
+            ++Cons;
+            ++Count;
+
+            // the rest of the window is picked up by the re-queued DPC
+            if (__RawHidOverBudget(RawHid, Count, Start))
+                break;
+        }
+
+        KeMemoryBarrier();
+
+        RawHid->Shared->in_cons = Cons;
+
+        if (RawHid->Stalled)
+            break;
+    }
+}
+
+KDEFERRED_ROUTINE RawHidDpc;
+
+VOID
+RawHidDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENHID_RAWHID  RawHid = Context;
+    PXENHID_FDO     Fdo;
+    BOOLEAN         Exhausted;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    Fdo = FrontendGetFdo(RawHid->Frontend);
+
+    KeAcquireSpinLockAtDpcLevel(&RawHid->Lock);
+
+    // checked under the lock, which __RawHidQuiesce() takes
+    if (!RawHid->Connected)
+        goto done;
+
+    RawHidPoll(RawHid, &Exhausted);
+
+    // While stalled the channel stays masked; the next read re-queues
+    // this DPC
+    if (RawHid->Stalled)
+        goto done;
+
+    if (Exhausted) {
+        // Out of budget with work left: stay masked, and give other
+        // DPCs on this processor a turn before carrying on
+        ++RawHid->NumExhausted;
+        (VOID) KeInsertQueueDpc(&RawHid->Dpc, NULL, NULL);
+        goto done;
+    }
+
+    (VOID) EVTCHN(Unmask, FdoEvtchnInterface(Fdo), RawHid->Evtchn, FALSE);
+
+    KeMemoryBarrier();
+
+    if (RawHid->Shared->in_prod != RawHid->Shared->in_cons)
+        (VOID) KeInsertQueueDpc(&RawHid->Dpc, NULL, NULL);
+
+done:
+    KeReleaseSpinLockFromDpcLevel(&RawHid->Lock);
+}
+
+KSERVICE_ROUTINE    RawHidInterrupt;
+
+BOOLEAN
+RawHidInterrupt(
+    IN  PKINTERRUPT         Interrupt,
+    IN  PVOID               Context
+    )
+{
+    PXENHID_RAWHID  RawHid = Context;
+
+    UNREFERENCED_PARAMETER(Interrupt);
+
+    ++RawHid->NumInts;
+    if (KeInsertQueueDpc(&RawHid->Dpc, NULL, NULL))
+        ++RawHid->NumEvts;
+
+    return TRUE;
+}
+
+static FORCEINLINE LONG
+__HexDigit(
+    IN  CHAR                Char
+    )
+{
+    if (Char >= '0' && Char <= '9')
+        return Char - '0';
+    if (Char >= 'a' && Char <= 'f')
+        return Char - 'a' + 10;
+    if (Char >= 'A' && Char <= 'F')
+        return Char - 'A' + 10;
+    return -1;
+}
+
+// Stop the DPC touching the ring and the channel. The channel is masked
+// on every upcall and only the DPC unmasks it, so once Connected is
+// clear under the lock the DPC takes, it stays masked and no poll is
+// part way through; any DPC still queued is then waited out.
+static VOID
+__RawHidQuiesce(
+    IN  PXENHID_RAWHID      RawHid
+    )
+{
+    KIRQL   Irql;
+
+    KeAcquireSpinLock(&RawHid->Lock, &Irql);
+    RawHid->Connected = FALSE;
+    KeReleaseSpinLock(&RawHid->Lock, Irql);
+
+    KeFlushQueuedDpcs();
+}
+
+static NTSTATUS
+__RawHidReadDescriptor(
+    IN  PXENHID_RAWHID      RawHid
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+    PCHAR           Buffer;
+    PCHAR           Cursor;
+    ULONG           Length;
+    NTSTATUS        status;
+
+    // hex encoded, two digits per byte
+    status = STORE(Read,
+                    FdoStoreInterface(Fdo),
+                    NULL,
+                    FrontendGetBackendPath(RawHid->Frontend),
+                    "report-descriptor",
+                    &Buffer);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Length = (ULONG)strlen(Buffer);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length == 0 || (Length & 1) != 0 ||
+        Length / 2 > RAWHID_MAX_DESCRIPTOR_LENGTH)
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    RawHid->ReportDescriptor = __RawHidAllocate(Length / 2);
+    if (RawHid->ReportDescriptor == NULL)
+        goto fail3;
+
+    status = STATUS_INVALID_PARAMETER;
+    for (Cursor = Buffer; *Cursor != '\0'; Cursor += 2) {
+        LONG    High = __HexDigit(Cursor[0]);
+        LONG    Low = __HexDigit(Cursor[1]);
+
+        if (High < 0 || Low < 0)
+            goto fail4;
+
+        RawHid->ReportDescriptor[RawHid->ReportDescriptorLength++] = (UCHAR)((High << 4) | Low);
+    }
+
+    STORE(Free, FdoStoreInterface(Fdo), Buffer);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+    __RawHidFree(RawHid->ReportDescriptor);
+    RawHid->ReportDescriptor = NULL;
+    RawHid->ReportDescriptorLength = 0;
+fail3:
+    Error("fail3\n");
+fail2:
+    Error("fail2\n");
+    STORE(Free, FdoStoreInterface(Fdo), Buffer);
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+#define RAWHID_MAX_PUSH     8
+
+// The longest input report the descriptor describes, in bytes and
+// including the report ID if it uses them. Only the global items that
+// size reports are followed.
+static ULONG
+__RawHidMaxInputLength(
+    IN  PXENHID_RAWHID      RawHid
+    )
+{
+    struct {
+        ULONG   Size;
+        ULONG   Count;
+        ULONG   Id;
+    }           State, Stack[RAWHID_MAX_PUSH];
+    ULONG       Depth;
+    PULONGLONG  Bits;
+    PUCHAR      Item;
+    PUCHAR      End;
+    BOOLEAN     Ids;
+    ULONG       Length;
+    ULONG       Index;
+
+    // one running total per report ID
+    Bits = __RawHidAllocate(256 * sizeof(ULONGLONG));
+    if (Bits == NULL)
+        return 0;
+
+    RtlZeroMemory(&State, sizeof(State));
+    Depth = 0;
+    Ids = FALSE;
+
+    Item = RawHid->ReportDescriptor;
+    End = Item + RawHid->ReportDescriptorLength;
+
+    while (Item < End) {
+        UCHAR   Prefix = *Item++;
+        ULONG   Size;
+        ULONG   Data;
+
+        // long items: size byte, tag byte, data
+        if (Prefix == 0xFE) {
+            if (Item == End)
+                break;
+            Item += 2 + *Item;
+            continue;
+        }
+
+        Size = Prefix & 0x03;
+        if (Size == 3)
+            Size = 4;
+        if ((ULONG)(End - Item) < Size)
+            break;
+
+        Data = 0;
+        for (Index = 0; Index < Size; ++Index)
+            Data |= (ULONG)Item[Index] << (8 * Index);
+        Item += Size;
+
+        switch (Prefix & 0xFC) {
+        case 0x74:  // Report Size
+            State.Size = Data;
+            break;
+
+        case 0x94:  // Report Count
+            State.Count = Data;
+            break;
+
+        case 0x84:  // Report ID
+            State.Id = Data & 0xFF;
+            Ids = TRUE;
+            break;
+
+        case 0xA4:  // Push
+            if (Depth < RAWHID_MAX_PUSH)
+                Stack[Depth++] = State;
+            break;
+
+        case 0xB4:  // Pop
+            if (Depth != 0)
+                State = Stack[--Depth];
+            break;
+
+        case 0x80:  // Input
+            Bits[State.Id] += (ULONGLONG)State.Size * State.Count;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    Length = 0;
+    for (Index = 0; Index < 256; ++Index) {
+        ULONGLONG   Bytes = (Bits[Index] + 7) / 8;
+
+        if (Bytes == 0)
+            continue;
+
+        if (Ids)
+            ++Bytes;
+
+        if (Bytes > MAXULONG)
+            Bytes = MAXULONG;
+
+        if ((ULONG)Bytes > Length)
+            Length = (ULONG)Bytes;
+    }
+
+    __RawHidFree(Bits);
+
+    return Length;
+}
+
+static USHORT
+__RawHidReadIdentity(
+    IN  PXENHID_RAWHID      RawHid,
+    IN  PCHAR               Node,
+    IN  USHORT              Default
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+    PCHAR           Buffer;
+    USHORT          Value;
+    NTSTATUS        status;
+
+    status = STORE(Read,
+                    FdoStoreInterface(Fdo),
+                    NULL,
+                    FrontendGetBackendPath(RawHid->Frontend),
+                    Node,
+                    &Buffer);
+    if (!NT_SUCCESS(status))
+        return Default;
+
+    Value = (USHORT)strtoul(Buffer, NULL, 16);
+    STORE(Free, FdoStoreInterface(Fdo), Buffer);
+
+    return Value;
+}
+
+static NTSTATUS
+RawHid_Create(
+    IN  PXENHID_FRONTEND            Frontend,
+    OUT PXENHID_CONTEXT*            Context
+    )
+{
+    NTSTATUS        status;
+    PXENHID_RAWHID  RawHid;
+    LARGE_INTEGER   Frequency;
+
+    Trace("====>\n");
+
+    status = STATUS_NO_MEMORY;
+    RawHid = __RawHidAllocate(sizeof(XENHID_RAWHID));
+    if (RawHid == NULL)
+        goto fail1;
+
+    RawHid->Frontend = Frontend;
+    KeInitializeSpinLock(&RawHid->Lock);
+    KeInitializeDpc(&RawHid->Dpc, RawHidDpc, RawHid);
+
+    RawHid->EventBudget = DriverGetParameters()->DpcEventBudget;
+
+    // convert to performance counter ticks
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+    RawHid->TimeBudget = ((ULONGLONG)DriverGetParameters()->DpcTimeBudget *
+                          (ULONGLONG)Frequency.QuadPart) / 1000000ull;
+
+    *Context = (PXENHID_CONTEXT)RawHid;
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+static VOID
+RawHid_Destroy(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    Trace("====>\n");
+
+    RawHid->Frontend = NULL;
+    RtlZeroMemory(&RawHid->Lock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&RawHid->Dpc, sizeof(KDPC));
+    RawHid->Stalled = FALSE;
+    RawHid->EventBudget = 0;
+    RawHid->TimeBudget = 0;
+    RawHid->NumInts = RawHid->NumEvts = 0;
+    RawHid->NumReports = RawHid->NumStalls = 0;
+    RawHid->NumInvalid = RawHid->NumOversized = 0;
+    RawHid->NumExhausted = 0;
+    RawHid->NumOverruns = RawHid->NumDropped = 0;
+
+    ASSERT(IsZeroMemory(Context, sizeof(XENHID_RAWHID)));
+    __RawHidFree(Context);
+
+    Trace("<==== STATUS_SUCCESS\n");
+}
+
+static NTSTATUS
+RawHid_Connect(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    NTSTATUS        status;
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+    ULONG           Length;
+
+    Trace("====>\n");
+
+    status = __RawHidReadDescriptor(RawHid);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // such reports are dropped, so say so now rather than leave the
+    // device looking dead
+    Length = __RawHidMaxInputLength(RawHid);
+    if (Length > RAWHID_MAX_REPORT_LENGTH)
+        Error("descriptor has %u byte input reports (at most %u fit in a slot)\n",
+              Length,
+              RAWHID_MAX_REPORT_LENGTH);
+
+    RawHid->DeviceAttributes.Size = sizeof(HID_DEVICE_ATTRIBUTES);
+    RawHid->DeviceAttributes.VendorID = __RawHidReadIdentity(RawHid, "vendor-id", 0x5853);
+    RawHid->DeviceAttributes.ProductID = __RawHidReadIdentity(RawHid, "product-id", 0x0001);
+    RawHid->DeviceAttributes.VersionNumber = __RawHidReadIdentity(RawHid, "version", 0x0101);
+
+    RawHid->DeviceDescriptor.bLength = sizeof(HID_DESCRIPTOR);
+    RawHid->DeviceDescriptor.bDescriptorType = 0x21;
+    RawHid->DeviceDescriptor.bcdHID = 0x0111;
+    RawHid->DeviceDescriptor.bCountry = 0x00;
+    RawHid->DeviceDescriptor.bNumDescriptors = 0x01;
+    RawHid->DeviceDescriptor.DescriptorList[0].bReportType = 0x22;
+    RawHid->DeviceDescriptor.DescriptorList[0].wReportLength = (USHORT)RawHid->ReportDescriptorLength;
+
+    Info("%04x:%04x (%u byte descriptor)\n",
+         RawHid->DeviceAttributes.VendorID,
+         RawHid->DeviceAttributes.ProductID,
+         RawHid->ReportDescriptorLength);
+
+    status = STATUS_NO_MEMORY;
+    RawHid->Shared = __RawHidAllocate(PAGE_SIZE);
+    if (RawHid->Shared == NULL)
+        goto fail2;
+
+    status = GNTTAB(Get, FdoGnttabInterface(Fdo), &RawHid->GrantRef);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = GNTTAB(PermitForeignAccess, 
+                    FdoGnttabInterface(Fdo), 
+                    RawHid->GrantRef, 
+                    FrontendGetBackendDomain(RawHid->Frontend), 
+                    GNTTAB_ENTRY_FULL_PAGE, 
+                    __Pfn(RawHid->Shared), 
+                    FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = STATUS_UNSUCCESSFUL;
+    RawHid->Evtchn = EVTCHN(Open, 
+                        FdoEvtchnInterface(Fdo),
+                        EVTCHN_UNBOUND,
+                        RawHidInterrupt,
+                        RawHid,
+                        FrontendGetBackendDomain(RawHid->Frontend),
+                        TRUE);
+    if (RawHid->Evtchn == NULL)
+        goto fail5;
+
+    RawHid->Connected = TRUE;
+    (VOID) EVTCHN(Unmask, FdoEvtchnInterface(Fdo), RawHid->Evtchn, FALSE);
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+    GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), RawHid->GrantRef);
+fail4:
+    Error("fail4\n");
+    GNTTAB(Put, FdoGnttabInterface(Fdo), RawHid->GrantRef);
+    RawHid->GrantRef = 0;
+fail3:
+    Error("fail3\n");
+    __RawHidFree(RawHid->Shared);
+    RawHid->Shared = NULL;
+fail2:
+    Error("fail2\n");
+    RtlZeroMemory(&RawHid->DeviceAttributes, sizeof(HID_DEVICE_ATTRIBUTES));
+    RtlZeroMemory(&RawHid->DeviceDescriptor, sizeof(HID_DESCRIPTOR));
+    __RawHidFree(RawHid->ReportDescriptor);
+    RawHid->ReportDescriptor = NULL;
+    RawHid->ReportDescriptorLength = 0;
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+// The backend is new after suspend/resume but the descriptor and our
+// page are not: re-grant the page and re-open the channel
+static NTSTATUS
+RawHid_Resume(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    NTSTATUS        status;
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+    KIRQL           Irql;
+
+    Trace("====>\n");
+
+    // nothing may read the ring while it is zeroed below
+    __RawHidQuiesce(RawHid);
+
+    EVTCHN(Close, FdoEvtchnInterface(Fdo), RawHid->Evtchn);
+    RawHid->Evtchn = NULL;
+
+    // the old grant is void; revoke it before granting the page afresh
+    GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), RawHid->GrantRef);
+
+    RtlZeroMemory(RawHid->Shared, PAGE_SIZE);
+
+    status = GNTTAB(PermitForeignAccess, 
+                    FdoGnttabInterface(Fdo), 
+                    RawHid->GrantRef, 
+                    FrontendGetBackendDomain(RawHid->Frontend), 
+                    GNTTAB_ENTRY_FULL_PAGE, 
+                    __Pfn(RawHid->Shared), 
+                    FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STATUS_UNSUCCESSFUL;
+    RawHid->Evtchn = EVTCHN(Open, 
+                        FdoEvtchnInterface(Fdo),
+                        EVTCHN_UNBOUND,
+                        RawHidInterrupt,
+                        RawHid,
+                        FrontendGetBackendDomain(RawHid->Frontend),
+                        TRUE);
+    if (RawHid->Evtchn == NULL)
+        goto fail2;
+
+    KeAcquireSpinLock(&RawHid->Lock, &Irql);
+    RawHid->Connected = TRUE;
+    KeReleaseSpinLock(&RawHid->Lock, Irql);
+
+    (VOID) EVTCHN(Unmask, FdoEvtchnInterface(Fdo), RawHid->Evtchn, FALSE);
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    // RawHid_Disconnect() still releases the page and reference
+    return status;
+}
+
+static NTSTATUS
+RawHid_WriteStore(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction
+    )
+{
+    NTSTATUS        status;
+    ULONG           Port;
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+
+    Trace("====>\n");
+
+    Port = EVTCHN(Port, FdoEvtchnInterface(Fdo), RawHid->Evtchn);
+
+    status = STORE(Printf, 
+                    FdoStoreInterface(Fdo), 
+                    Transaction,
+                    FdoGetStorePath(Fdo),
+                    "evtchn",
+                    "%u",
+                    Port);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STORE(Printf,
+                    FdoStoreInterface(Fdo),
+                    Transaction,
+                    FdoGetStorePath(Fdo),
+                    "gnttab",
+                    "%u",
+                    RawHid->GrantRef);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+static VOID 
+RawHid_Disconnect(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+    PXENHID_FDO     Fdo = FrontendGetFdo(RawHid->Frontend);
+
+    Trace("====>\n");
+
+    __RawHidQuiesce(RawHid);
+
+    // a failed resume leaves no channel open
+    if (RawHid->Evtchn != NULL)
+        EVTCHN(Close, FdoEvtchnInterface(Fdo), RawHid->Evtchn);
+    RawHid->Evtchn = NULL;
+
+    GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), RawHid->GrantRef);
+    GNTTAB(Put, FdoGnttabInterface(Fdo), RawHid->GrantRef);
+    RawHid->GrantRef = 0;
+
+    __RawHidFree(RawHid->Shared);
+    RawHid->Shared = NULL;
+
+    RtlZeroMemory(&RawHid->DeviceAttributes, sizeof(HID_DEVICE_ATTRIBUTES));
+    RtlZeroMemory(&RawHid->DeviceDescriptor, sizeof(HID_DESCRIPTOR));
+    __RawHidFree(RawHid->ReportDescriptor);
+    RawHid->ReportDescriptor = NULL;
+    RawHid->ReportDescriptorLength = 0;
+
+    Trace("<==== STATUS_SUCCESS\n");
+}
+
+static VOID
+RawHid_DebugCallback(
+    IN  PXENHID_CONTEXT             Context, 
+    IN  PXENBUS_DEBUG_INTERFACE     DebugInterface,
+    IN  PXENBUS_DEBUG_CALLBACK      DebugCallback
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Device: %04x:%04x Descriptor: %u bytes\n",
+            RawHid->DeviceAttributes.VendorID,
+            RawHid->DeviceAttributes.ProductID,
+            RawHid->ReportDescriptorLength);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Interrupts: %u DPCs: %u\n",
+            RawHid->NumInts,
+            RawHid->NumEvts);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Reports: %u Invalid: %u Oversized: %u Stalls: %u%s\n",
+            RawHid->NumReports,
+            RawHid->NumInvalid,
+            RawHid->NumOversized,
+            RawHid->NumStalls,
+            RawHid->Stalled ? " (STALLED)" : "");
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Overruns: %u Dropped: %u Exhausted: %u\n",
+            RawHid->NumOverruns,
+            RawHid->NumDropped,
+            RawHid->NumExhausted);
+}
+
+static NTSTATUS
+RawHid_GetDeviceAttributes(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    Trace("====>\n");
+
+    // only known once the backend has been read
+    if (RawHid == NULL)
+        return STATUS_DEVICE_NOT_READY;
+
+    if (Length < sizeof(HID_DEVICE_ATTRIBUTES))
+        goto fail1;
+
+    RtlCopyMemory(Buffer, &RawHid->DeviceAttributes, sizeof(HID_DEVICE_ATTRIBUTES));
+    *Information = sizeof(HID_DEVICE_ATTRIBUTES);
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", STATUS_INVALID_BUFFER_SIZE);
+    return STATUS_INVALID_BUFFER_SIZE;
+}
+
+static NTSTATUS
+RawHid_GetDeviceDescriptor(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    Trace("====>\n");
+
+    if (RawHid == NULL)
+        return STATUS_DEVICE_NOT_READY;
+
+    if (Length < sizeof(HID_DESCRIPTOR))
+        goto fail1;
+
+    RtlCopyMemory(Buffer, &RawHid->DeviceDescriptor, sizeof(HID_DESCRIPTOR));
+    *Information = sizeof(HID_DESCRIPTOR);
+    
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", STATUS_INVALID_BUFFER_SIZE);
+    return STATUS_INVALID_BUFFER_SIZE;
+}
+
+static NTSTATUS
+RawHid_GetReportDescriptor(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    Trace("====>\n");
+
+    if (RawHid == NULL)
+        return STATUS_DEVICE_NOT_READY;
+
+    if (Length < RawHid->ReportDescriptorLength)
+        goto fail1;
+
+    RtlCopyMemory(Buffer, RawHid->ReportDescriptor, RawHid->ReportDescriptorLength);
+    *Information = RawHid->ReportDescriptorLength;
+    
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", STATUS_INVALID_BUFFER_SIZE);
+    return STATUS_INVALID_BUFFER_SIZE;
+}
+
+static NTSTATUS
+RawHid_GetFeature(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(Information);
+    Trace("====>\n");
+
+    Trace("<==== STATUS_NOT_SUPPORTED\n");
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+RawHid_SetFeature(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+    Trace("====>\n");
+
+    Trace("<==== STATUS_NOT_SUPPORTED\n");
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+RawHid_GetInputReport(
+    IN  PXENHID_CONTEXT             Context,
+    IN  UCHAR                       ReportId,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(ReportId);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(Information);
+    Trace("====>\n");
+
+    // reports are passed through as they arrive; none are kept
+    Trace("<==== STATUS_NOT_SUPPORTED\n");
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+RawHid_WriteReport(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+    Trace("====>\n");
+
+    Trace("<==== STATUS_NOT_SUPPORTED\n");
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+RawHid_ReadReport(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    PXENHID_RAWHID  RawHid = (PXENHID_RAWHID)Context;
+
+    // a report left on the ring for want of a read can now go
+    if (RawHid->Connected)
+        (VOID) KeInsertQueueDpc(&RawHid->Dpc, NULL, NULL);
+
+    return STATUS_PENDING;
+}
+
+static XENHID_OPERATIONS RawHid_Operations = {
+    RawHid_Create,
+    RawHid_Destroy,
+    RawHid_Connect,
+    RawHid_Resume,
+    RawHid_WriteStore,
+    RawHid_Disconnect,
+    RawHid_DebugCallback,
+    RawHid_GetDeviceAttributes,
+    RawHid_GetDeviceDescriptor,
+    RawHid_GetReportDescriptor,
+    RawHid_GetFeature,
+    RawHid_SetFeature,
+    RawHid_GetInputReport,
+    RawHid_WriteReport,
+    RawHid_ReadReport
+};
+
+NTSTATUS
+RawHidInitialize(
+    OUT PXENHID_OPERATIONS  Operations
+    )
+{
+    *Operations = RawHid_Operations;
+    return STATUS_SUCCESS;
+}
+
@@ -32,7 +32,8 @@
 #ifndef _XENHID_REPORTDESCR_H
 #define _XENHID_REPORTDESCR_H
 
-#define VKBD_REPORT_DESCRIPTOR      \
+// Boot-style keyboard: modifier bits plus an array of up to 6 keys
+#define VKBD_KEYBOARD_COLLECTION    \
     0x05, 0x01,         /* USAGE_PAGE (Generic Desktop)                    */ \
     0x09, 0x06,         /* USAGE (Keyboard)                                */ \
     0xa1, 0x01,         /* COLLECTION (Application)                        */ \
@@ -48,6 +49,15 @@
     0x95, 0x01,         /*   REPORT_COUNT (1)                              */ \
     0x75, 0x08,         /*   REPORT_SIZE (8)                               */ \
     0x81, 0x03,         /*   INPUT (Cnst,Var,Abs)                          */ \
+    0x95, 0x05,         /*   REPORT_COUNT (5)                              */ \
+    0x75, 0x01,         /*   REPORT_SIZE (1)                               */ \
+    0x05, 0x08,         /*   USAGE_PAGE (LEDs)                             */ \
+    0x19, 0x01,         /*   USAGE_MINIMUM (Num Lock)                      */ \
+    0x29, 0x05,         /*   USAGE_MAXIMUM (Kana)                          */ \
+    0x91, 0x02,         /*   OUTPUT (Data,Var,Abs)                         */ \
+    0x95, 0x01,         /*   REPORT_COUNT (1)                              */ \
+    0x75, 0x03,         /*   REPORT_SIZE (3)                               */ \
+    0x91, 0x03,         /*   OUTPUT (Cnst,Var,Abs)                         */ \
     0x95, 0x06,         /*   REPORT_COUNT (6)                              */ \
     0x75, 0x08,         /*   REPORT_SIZE (8)                               */ \
     0x15, 0x00,         /*   LOGICAL_MINIMUM (0)                           */ \
@@ -56,7 +66,43 @@
     0x19, 0x00,         /*   USAGE_MINIMUM (Reserved (no event indicated)) */ \
     0x29, 0x65,         /*   USAGE_MAXIMUM (Keyboard Application)          */ \
     0x81, 0x00,         /*   INPUT (Data,Ary,Abs)                          */ \
-    0xc0,               /* END_COLLECTION                                  */ \
+    0xc0,               /* END_COLLECTION                                  */
+
+// N-key rollover keyboard: modifier bits plus one bit per key usage
+#define VKBD_NKRO_KEYBOARD_COLLECTION   \
+    0x05, 0x01,         /* USAGE_PAGE (Generic Desktop)                    */ \
+    0x09, 0x06,         /* USAGE (Keyboard)                                */ \
+    0xa1, 0x01,         /* COLLECTION (Application)                        */ \
+    0x85, 0x01,         /*   REPORT_ID (1)                                 */ \
+    0x05, 0x07,         /*   USAGE_PAGE (Keyboard)                         */ \
+    0x19, 0xe0,         /*   USAGE_MINIMUM (Keyboard LeftControl)          */ \
+    0x29, 0xe7,         /*   USAGE_MAXIMUM (Keyboard Right GUI)            */ \
+    0x15, 0x00,         /*   LOGICAL_MINIMUM (0)                           */ \
+    0x25, 0x01,         /*   LOGICAL_MAXIMUM (1)                           */ \
+    0x75, 0x01,         /*   REPORT_SIZE (1)                               */ \
+    0x95, 0x08,         /*   REPORT_COUNT (8)                              */ \
+    0x81, 0x02,         /*   INPUT (Data,Var,Abs)                          */ \
+    0x95, 0x05,         /*   REPORT_COUNT (5)                              */ \
+    0x75, 0x01,         /*   REPORT_SIZE (1)                               */ \
+    0x05, 0x08,         /*   USAGE_PAGE (LEDs)                             */ \
+    0x19, 0x01,         /*   USAGE_MINIMUM (Num Lock)                      */ \
+    0x29, 0x05,         /*   USAGE_MAXIMUM (Kana)                          */ \
+    0x91, 0x02,         /*   OUTPUT (Data,Var,Abs)                         */ \
+    0x95, 0x01,         /*   REPORT_COUNT (1)                              */ \
+    0x75, 0x03,         /*   REPORT_SIZE (3)                               */ \
+    0x91, 0x03,         /*   OUTPUT (Cnst,Var,Abs)                         */ \
+    0x05, 0x07,         /*   USAGE_PAGE (Keyboard)                         */ \
+    0x19, 0x00,         /*   USAGE_MINIMUM (Reserved (no event indicated)) */ \
+    0x29, 0xdf,         /*   USAGE_MAXIMUM (0xDF)                          */ \
+    0x15, 0x00,         /*   LOGICAL_MINIMUM (0)                           */ \
+    0x25, 0x01,         /*   LOGICAL_MAXIMUM (1)                           */ \
+    0x75, 0x01,         /*   REPORT_SIZE (1)                               */ \
+    0x95, 0xe0,         /*   REPORT_COUNT (224)                            */ \
+    0x81, 0x02,         /*   INPUT (Data,Var,Abs)                          */ \
+    0xc0,               /* END_COLLECTION                                  */
+
+// Absolute (ID 2) and relative (ID 3) pointers
+#define VKBD_POINTER_COLLECTIONS    \
     0x05, 0x01,         /* USAGE_PAGE (Generic Desktop)                    */ \
     0x09, 0x02,         /* USAGE (Mouse)                                   */ \
     0xa1, 0x01,         /* COLLECTION (Application)                        */ \
@@ -89,7 +135,48 @@
     0x95, 0x01,         /*     REPORT_COUNT (1)                            */ \
     0x81, 0x06,         /*     INPUT (Data,Var,Rel)                        */ \
     0xc0,               /*   END_COLLECTION                                */ \
+    0xc0,               /* END_COLLECTION                                  */ \
+    0x05, 0x01,         /* USAGE_PAGE (Generic Desktop)                    */ \
+    0x09, 0x02,         /* USAGE (Mouse)                                   */ \
+    0xa1, 0x01,         /* COLLECTION (Application)                        */ \
+    0x85, 0x03,         /*   REPORT_ID (3)                                 */ \
+    0x09, 0x01,         /*   USAGE (Pointer)                               */ \
+    0xa1, 0x00,         /*   COLLECTION (Physical)                         */ \
+    0x05, 0x09,         /*     USAGE_PAGE (Button)                         */ \
+    0x19, 0x01,         /*     USAGE_MINIMUM (Button 1)                    */ \
+    0x29, 0x05,         /*     USAGE_MAXIMUM (Button 5)                    */ \
+    0x15, 0x00,         /*     LOGICAL_MINIMUM (0)                         */ \
+    0x25, 0x01,         /*     LOGICAL_MAXIMUM (1)                         */ \
+    0x95, 0x05,         /*     REPORT_COUNT (5)                            */ \
+    0x75, 0x01,         /*     REPORT_SIZE (1)                             */ \
+    0x81, 0x02,         /*     INPUT (Data,Var,Abs)                        */ \
+    0x95, 0x01,         /*     REPORT_COUNT (1)                            */ \
+    0x75, 0x03,         /*     REPORT_SIZE (3)                             */ \
+    0x81, 0x03,         /*     INPUT (Cnst,Var,Abs)                        */ \
+    0x05, 0x01,         /*     USAGE_PAGE (Generic Desktop)                */ \
+    0x09, 0x30,         /*     USAGE (X)                                   */ \
+    0x09, 0x31,         /*     USAGE (Y)                                   */ \
+    0x16, 0x01, 0x80,   /*     LOGICAL_MINIMUM (-32767)                    */ \
+    0x26, 0xff, 0x7f,   /*     LOGICAL_MAXIMUM (32767)                     */ \
+    0x75, 0x10,         /*     REPORT_SIZE (16)                            */ \
+    0x95, 0x02,         /*     REPORT_COUNT (2)                            */ \
+    0x81, 0x06,         /*     INPUT (Data,Var,Rel)                        */ \
+    0x09, 0x38,         /*     USAGE (Z)                                   */ \
+    0x15, 0x81,         /*     LOGICAL_MINIMUM (-127)                      */ \
+    0x25, 0x7f,         /*     LOGICAL_MAXIMUM (127)                       */ \
+    0x75, 0x08,         /*     REPORT_SIZE (8)                             */ \
+    0x95, 0x01,         /*     REPORT_COUNT (1)                            */ \
+    0x81, 0x06,         /*     INPUT (Data,Var,Rel)                        */ \
+    0xc0,               /*   END_COLLECTION                                */ \
     0xc0                /* END_COLLECTION                                  */
 
+#define VKBD_REPORT_DESCRIPTOR      \
+    VKBD_KEYBOARD_COLLECTION        \
+    VKBD_POINTER_COLLECTIONS
+
+#define VKBD_NKRO_REPORT_DESCRIPTOR \
+    VKBD_NKRO_KEYBOARD_COLLECTION   \
+    VKBD_POINTER_COLLECTIONS
+
 #endif // _XENHID_REPORTDESCR_H
 
@@ -39,13 +39,21 @@
 #include <gnttab_interface.h>
 #include <hidport.h>
 #include <xen.h>
+#include <stdlib.h>
+#include <ntstrsafe.h>
 #include "dbg_print.h"
 #include "assert.h"
 
+// Keys is either an array of up to 6 held usages or, with N-key
+// rollover, a bitmap of usages 0x00-0xDF (0xE0 on are modifiers).
+// Reports only go as far as the mode needs; see KeyLength.
+#define VKBD_ARRAY_KEYS     6
+#define VKBD_BITMAP_KEYS    0xE0
+
 typedef struct _XENHID_KEYBOARD {
     UCHAR   ReportId; // = 1
     UCHAR   Modifiers;
-    UCHAR   Keys[6];
+    UCHAR   Keys[VKBD_BITMAP_KEYS / 8];
 } XENHID_KEYBOARD, *PXENHID_KEYBOARD;
 
 typedef struct _XENHID_MOUSE {
@@ -56,22 +64,171 @@ typedef struct _XENHID_MOUSE {
     CHAR    Z;
 } XENHID_MOUSE, *PXENHID_MOUSE;
 
+typedef struct _XENHID_RELMOUSE {
+    UCHAR   ReportId; // = 3
+    UCHAR   Buttons;
+    SHORT   X;
+    SHORT   Y;
+    CHAR    Z;
+} XENHID_RELMOUSE, *PXENHID_RELMOUSE;
+
+#define MOUSE_BUTTON        1
+#define KEYBOARD_MODIFIER   2
+#define KEYBOARD_KEY        3
+
+typedef struct _VKBD_KEYMAP_ENTRY {
+    UCHAR   Type;
+    UCHAR   Value;
+} VKBD_KEYMAP_ENTRY, *PVKBD_KEYMAP_ENTRY;
+
+// Generated from keymap.txt by build.py
+#include <keymap.h>
+
+// Copy of the current state for readers outside the DPC. The DPC is the
+// only writer: it makes Sequence odd, updates the copy and makes it even
+// again, so a reader that sees the same even Sequence either side of its
+// copy has a consistent one. Neither side takes a lock.
+typedef struct _VKBD_SNAPSHOT {
+    volatile LONG       Sequence;
+    XENHID_KEYBOARD     KeyState;
+    XENHID_MOUSE        MouState;
+    XENHID_RELMOUSE     RelState;
+} VKBD_SNAPSHOT, *PVKBD_SNAPSHOT;
+
+// Extended in-ring: (1 << order) separately granted pages, used as a
+// power-of-two number of event slots. Indices stay in the shared page.
+#define VKBD_MAX_IN_RING_PAGE_ORDER 4
+#define VKBD_MAX_IN_RING_PAGES      (1 << VKBD_MAX_IN_RING_PAGE_ORDER)
+
+// Keyboard reports that could not be delivered are queued, never merged,
+// so a fast press/release is not lost. Must be a power of two.
+#define VKBD_KEY_FIFO_LENGTH    32
+
+// Latency stages, each kept as a log2 histogram of microseconds
+typedef enum _VKBD_STAGE {
+    VKBD_STAGE_BACKEND = 0,     // backend stamp -> DPC (less the smallest seen)
+    VKBD_STAGE_INTERRUPT,       // interrupt -> DPC
+    VKBD_STAGE_REPORT,          // DPC -> read IRP completed
+    VKBD_STAGE_COUNT
+} VKBD_STAGE;
+
+static const CHAR*
+VkbdStageName[VKBD_STAGE_COUNT] = {
+    "Backend",
+    "Interrupt",
+    "Report"
+};
+
+#define VKBD_HISTOGRAM_BUCKETS  16
+
+// kbdif.h defines no out events, so LED state is only sent to backends
+// that ask for it with feature-leds
+#define VKBD_OUT_TYPE_LEDS      1
+
+struct vkbd_out_leds {
+    uint8_t type;           // VKBD_OUT_TYPE_LEDS
+    uint8_t leds;           // HID LED usages 1-5 as bits 0-4
+};
+
+#define VKBD_LEDS_MASK          0x1F
+
+// With timestamps negotiated the backend puts a 64-bit stamp (ns, own
+// clock) in the otherwise unused tail of every event
+#define VKBD_TIMESTAMP_OFFSET   32
+
 typedef struct _XENHID_VKBD {
     PXENHID_FRONTEND            Frontend;
+    BOOLEAN                     Connected;
+    KSPIN_LOCK                  Lock;
     KDPC                        Dpc;
+    KTIMER                      Timer;
+    LARGE_INTEGER               PollInterval;
+    BOOLEAN                     Polling;
+    ULONG                       EventBudget;
+    ULONGLONG                   TimeBudget;
     ULONG                       NumInts;
     ULONG                       NumEvts;
+    ULONG                       NumPolls;
+    ULONG                       NumMitigated;
+    ULONG                       NumExhausted;
+    BOOLEAN                     FlowControl;
+    BOOLEAN                     Stalled;
+    ULONG                       NumStalls;
+
+    ULONGLONG                   PointerInterval;
+    ULONGLONG                   PointerBound;
+    ULONGLONG                   LastPointer;
+    ULONGLONG                   PointerWaiting;
+    ULONGLONG                   PointerDue;
+    ULONG                       NumShaped;
+    ULONG                       NumBypassed;
+
+    BOOLEAN                     FeatureLeds;
+    KSPIN_LOCK                  OutLock;
+    KDPC                        OutDpc;
+    UCHAR                       Leds;
+    UCHAR                       LedsSent;
+    ULONG                       NumLedWrites;
+    ULONG                       NumLedEvents;
+    ULONG                       NumOutNotifies;
+    ULONG                       NumOutFull;
+
+    BOOLEAN                     Timestamps;
+    BOOLEAN                     BackendTimestamps;
+    ULONGLONG                   Frequency;
+    ULONGLONG                   InterruptStamp;
+    ULONGLONG                   DpcStamp;
+    LONGLONG                    MinBackendDelta;
+    ULONG                       Histogram[VKBD_STAGE_COUNT][VKBD_HISTOGRAM_BUCKETS];
 
     struct xenkbd_page*         Shared;
     PXENBUS_EVTCHN_DESCRIPTOR   Evtchn;
     ULONG                       GrantRef;
+
+    BOOLEAN                     Extended;
+    ULONG                       InRingOrder;
+    ULONG                       InRingLen;
+    union xenkbd_in_event*      InRing;
+    ULONG                       InRingRef[VKBD_MAX_IN_RING_PAGES];
     
+    BOOLEAN                     Nkro;
+    ULONG                       KeyLength;
+    VKBD_KEYMAP_ENTRY           Keymap[VKBD_KEYMAP_SIZE];
+    ULONG                       NumOverrides;
+
+    BOOLEAN                     AbsPointer;
+    BOOLEAN                     Relative;
+    UCHAR                       Carried;
+
     XENHID_KEYBOARD             KeyState;
     XENHID_MOUSE                MouState;
-    BOOLEAN                     KeyPending;
-    BOOLEAN                     MouPending;
+    XENHID_RELMOUSE             RelState;
+    ULONG                       KeyBatch;
+    ULONG                       MouBatch;
+    ULONG                       RelBatch;
+    VKBD_SNAPSHOT               Snapshot;
+    LONG                        NumSnapshotRetries;
+
+    XENHID_KEYBOARD             KeyFifo[VKBD_KEY_FIFO_LENGTH];
+    ULONG                       KeyFifoHead;
+    ULONG                       KeyFifoTail;
+    ULONG                       KeyFifoMax;
+    ULONG                       NumKeyQueued;
+    ULONG                       NumKeyFifoFull;
+
+    ULONG                       NumConsumed;
+    ULONG                       NumReports;
+    ULONG                       NumOverruns;
+    ULONG                       NumDropped;
 } XENHID_VKBD, *PXENHID_VKBD;
 
+// Transitions folded into KeyState/MouState since the last report
+#define VKBD_BATCH_MODIFIER_PRESS   0x00000001
+#define VKBD_BATCH_KEY_PRESS        0x00000002
+#define VKBD_BATCH_KEY_RELEASE      0x00000004
+#define VKBD_BATCH_MOTION           0x00000010
+#define VKBD_BATCH_BUTTON           0x00000020
+
 static HID_DEVICE_ATTRIBUTES 
 Vkbd_DeviceAttributes = {
     sizeof(HID_DEVICE_ATTRIBUTES),
@@ -85,6 +242,11 @@ Vkbd_ReportDescriptor[] = {
     VKBD_REPORT_DESCRIPTOR  // #defined to the right bytes!
 };
 
+static UCHAR
+Vkbd_NkroReportDescriptor[] = {
+    VKBD_NKRO_REPORT_DESCRIPTOR
+};
+
 static HID_DESCRIPTOR
 Vkbd_DeviceDescriptor = {
     sizeof (HID_DESCRIPTOR),
@@ -122,208 +284,64 @@ __VkbdFree(
     ExFreePoolWithTag(Buffer, VKBD_POOL_TAG);
 }
 
-#define MOUSE_BUTTON        1
-#define KEYBOARD_MODIFIER   2
-#define KEYBOARD_KEY        3
-
 static FORCEINLINE ULONG
 __UsasgeType(
+    IN  PXENHID_VKBD        Vkbd,
     IN  ULONG               Code,
     OUT PUCHAR              Value
     )
 {
-#define XENHID_KEY(_Code, _Value, _Type)        \
-    case (_Code):   *Value = (_Value);  return (_Type)
-
-    switch (Code) {
-        // KEYBOARD KEYS
-    XENHID_KEY( 1,      0x29,   KEYBOARD_KEY);
-    XENHID_KEY( 2,      0x1E,   KEYBOARD_KEY);
-    XENHID_KEY( 3,      0x1F,   KEYBOARD_KEY);
-    XENHID_KEY( 4,      0x20,   KEYBOARD_KEY);
-    XENHID_KEY( 5,      0x21,   KEYBOARD_KEY);
-    XENHID_KEY( 6,      0x22,   KEYBOARD_KEY);
-    XENHID_KEY( 7,      0x23,   KEYBOARD_KEY);
-    XENHID_KEY( 8,      0x24,   KEYBOARD_KEY);
-    XENHID_KEY( 9,      0x25,   KEYBOARD_KEY);
-    XENHID_KEY( 10,     0x26,   KEYBOARD_KEY);
-    XENHID_KEY( 11,     0x27,   KEYBOARD_KEY);
-    XENHID_KEY( 12,     0x2D,   KEYBOARD_KEY);
-    XENHID_KEY( 13,     0x2E,   KEYBOARD_KEY);
-    XENHID_KEY( 14,     0x2A,   KEYBOARD_KEY);
-    XENHID_KEY( 15,     0x2B,   KEYBOARD_KEY);
-    XENHID_KEY( 16,     0x14,   KEYBOARD_KEY);
-    XENHID_KEY( 17,     0x1A,   KEYBOARD_KEY);
-    XENHID_KEY( 18,     0x08,   KEYBOARD_KEY);
-    XENHID_KEY( 19,     0x15,   KEYBOARD_KEY);
-    XENHID_KEY( 20,     0x17,   KEYBOARD_KEY);
-    XENHID_KEY( 21,     0x1C,   KEYBOARD_KEY);
-    XENHID_KEY( 22,     0x18,   KEYBOARD_KEY);
-    XENHID_KEY( 23,     0x0C,   KEYBOARD_KEY);
-    XENHID_KEY( 24,     0x12,   KEYBOARD_KEY);
-    XENHID_KEY( 25,     0x13,   KEYBOARD_KEY);
-    XENHID_KEY( 26,     0x2F,   KEYBOARD_KEY);
-    XENHID_KEY( 27,     0x30,   KEYBOARD_KEY);
-    XENHID_KEY( 28,     0x28,   KEYBOARD_KEY);
-    XENHID_KEY( 29,     0xE0,   KEYBOARD_KEY);
-    XENHID_KEY( 30,     0x04,   KEYBOARD_KEY);
-    XENHID_KEY( 31,     0x16,   KEYBOARD_KEY);
-    XENHID_KEY( 32,     0x07,   KEYBOARD_KEY);
-    XENHID_KEY( 33,     0x09,   KEYBOARD_KEY);
-    XENHID_KEY( 34,     0x0A,   KEYBOARD_KEY);
-    XENHID_KEY( 35,     0x0B,   KEYBOARD_KEY);
-    XENHID_KEY( 36,     0x0D,   KEYBOARD_KEY);
-    XENHID_KEY( 37,     0x0E,   KEYBOARD_KEY);
-    XENHID_KEY( 38,     0x0F,   KEYBOARD_KEY);
-    XENHID_KEY( 39,     0x33,   KEYBOARD_KEY);
-    XENHID_KEY( 40,     0x34,   KEYBOARD_KEY);
-    XENHID_KEY( 41,     0x35,   KEYBOARD_KEY);
-    XENHID_KEY( 42,     0xE1,   KEYBOARD_KEY);
-    XENHID_KEY( 43,     0x31,   KEYBOARD_KEY);
-    XENHID_KEY( 44,     0x1D,   KEYBOARD_KEY);
-    XENHID_KEY( 45,     0x1B,   KEYBOARD_KEY);
-    XENHID_KEY( 46,     0x06,   KEYBOARD_KEY);
-    XENHID_KEY( 47,     0x19,   KEYBOARD_KEY);
-    XENHID_KEY( 48,     0x05,   KEYBOARD_KEY);
-    XENHID_KEY( 49,     0x11,   KEYBOARD_KEY);
-    XENHID_KEY( 50,     0x10,   KEYBOARD_KEY);
-    XENHID_KEY( 51,     0x36,   KEYBOARD_KEY);
-    XENHID_KEY( 52,     0x37,   KEYBOARD_KEY);
-    XENHID_KEY( 53,     0x38,   KEYBOARD_KEY);
-    XENHID_KEY( 54,     0xE5,   KEYBOARD_KEY);
-    XENHID_KEY( 55,     0x55,   KEYBOARD_KEY);
-    XENHID_KEY( 56,     0xE2,   KEYBOARD_KEY);
-    XENHID_KEY( 57,     0x2C,   KEYBOARD_KEY);
-    XENHID_KEY( 58,     0x39,   KEYBOARD_KEY);
-    XENHID_KEY( 59,     0x3A,   KEYBOARD_KEY);
-    XENHID_KEY( 60,     0x3B,   KEYBOARD_KEY);
-    XENHID_KEY( 61,     0x3C,   KEYBOARD_KEY);
-    XENHID_KEY( 62,     0x3D,   KEYBOARD_KEY);
-    XENHID_KEY( 63,     0x3E,   KEYBOARD_KEY);
-    XENHID_KEY( 64,     0x3F,   KEYBOARD_KEY);
-    XENHID_KEY( 65,     0x40,   KEYBOARD_KEY);
-    XENHID_KEY( 66,     0x41,   KEYBOARD_KEY);
-    XENHID_KEY( 67,     0x42,   KEYBOARD_KEY);
-    XENHID_KEY( 68,     0x43,   KEYBOARD_KEY);
-    XENHID_KEY( 69,     0x53,   KEYBOARD_KEY);
-    XENHID_KEY( 70,     0x47,   KEYBOARD_KEY);
-    XENHID_KEY( 71,     0x5F,   KEYBOARD_KEY);
-    XENHID_KEY( 72,     0x60,   KEYBOARD_KEY);
-    XENHID_KEY( 73,     0x61,   KEYBOARD_KEY);
-    XENHID_KEY( 74,     0x56,   KEYBOARD_KEY);
-    XENHID_KEY( 75,     0x5C,   KEYBOARD_KEY);
-    XENHID_KEY( 76,     0x5D,   KEYBOARD_KEY);
-    XENHID_KEY( 77,     0x5E,   KEYBOARD_KEY);
-    XENHID_KEY( 78,     0x57,   KEYBOARD_KEY);
-    XENHID_KEY( 79,     0x59,   KEYBOARD_KEY);
-    XENHID_KEY( 80,     0x5A,   KEYBOARD_KEY);
-    XENHID_KEY( 81,     0x5B,   KEYBOARD_KEY);
-    XENHID_KEY( 82,     0x62,   KEYBOARD_KEY);
-    XENHID_KEY( 83,     0x63,   KEYBOARD_KEY);
-    XENHID_KEY( 85,     0x87,   KEYBOARD_KEY);
-    XENHID_KEY( 86,     0x32,   KEYBOARD_KEY);
-    //XENHID_KEY( 86,     0x64,   KEYBOARD_KEY);
-    XENHID_KEY( 87,     0x44,   KEYBOARD_KEY);
-    XENHID_KEY( 88,     0x45,   KEYBOARD_KEY);
-    XENHID_KEY( 89,     0x88,   KEYBOARD_KEY);
-    XENHID_KEY( 90,     0x89,   KEYBOARD_KEY);
-    XENHID_KEY( 91,     0x8A,   KEYBOARD_KEY);
-    XENHID_KEY( 92,     0x8B,   KEYBOARD_KEY);
-    XENHID_KEY( 93,     0x8C,   KEYBOARD_KEY);
-    XENHID_KEY( 94,     0x8D,   KEYBOARD_KEY);
-    XENHID_KEY( 96,     0x58,   KEYBOARD_KEY);
-    XENHID_KEY( 97,     0xE4,   KEYBOARD_KEY);
-    XENHID_KEY( 98,     0x54,   KEYBOARD_KEY);
-    XENHID_KEY( 99,     0x46,   KEYBOARD_KEY);
-    XENHID_KEY( 100,    0xE6,   KEYBOARD_KEY); // 101
-    XENHID_KEY( 102,    0x4A,   KEYBOARD_KEY);
-    XENHID_KEY( 103,    0x52,   KEYBOARD_KEY);
-    XENHID_KEY( 104,    0x4B,   KEYBOARD_KEY);
-    XENHID_KEY( 105,    0x50,   KEYBOARD_KEY);
-    XENHID_KEY( 106,    0x4F,   KEYBOARD_KEY);
-    XENHID_KEY( 107,    0x4D,   KEYBOARD_KEY);
-    XENHID_KEY( 108,    0x51,   KEYBOARD_KEY);
-    XENHID_KEY( 109,    0x4E,   KEYBOARD_KEY);
-    XENHID_KEY( 110,    0x49,   KEYBOARD_KEY);
-    XENHID_KEY( 111,    0x4C,   KEYBOARD_KEY);
-    XENHID_KEY( 113,    0x7F,   KEYBOARD_KEY);
-    XENHID_KEY( 114,    0x81,   KEYBOARD_KEY);
-    XENHID_KEY( 115,    0x80,   KEYBOARD_KEY);
-    XENHID_KEY( 116,    0x66,   KEYBOARD_KEY);
-    XENHID_KEY( 117,    0x86,   KEYBOARD_KEY);
-    XENHID_KEY( 118,    0xD7,   KEYBOARD_KEY);
-    XENHID_KEY( 119,    0x48,   KEYBOARD_KEY); // 120
-    XENHID_KEY( 121,    0x85,   KEYBOARD_KEY);
-    XENHID_KEY( 122,    0x8E,   KEYBOARD_KEY);
-    XENHID_KEY( 123,    0x8F,   KEYBOARD_KEY);
-    XENHID_KEY( 124,    0x90,   KEYBOARD_KEY);
-    XENHID_KEY( 125,    0xE3,   KEYBOARD_KEY);
-    XENHID_KEY( 126,    0xE7,   KEYBOARD_KEY);
-    XENHID_KEY( 127,    0x65,   KEYBOARD_KEY); // 128, 129, 130
-    XENHID_KEY( 131,    0x7A,   KEYBOARD_KEY); // 132
-    XENHID_KEY( 133,    0x7C,   KEYBOARD_KEY); // 134
-    XENHID_KEY( 135,    0x7D,   KEYBOARD_KEY); // 135, 246
-    XENHID_KEY( 137,    0x7B,   KEYBOARD_KEY);
-    XENHID_KEY( 138,    0x75,   KEYBOARD_KEY);
-    XENHID_KEY( 139,    0x76,   KEYBOARD_KEY); // [140, 178]
-    XENHID_KEY( 179,    0xB6,   KEYBOARD_KEY);
-    XENHID_KEY( 180,    0xB7,   KEYBOARD_KEY); // 181
-    XENHID_KEY( 182,    0x79,   KEYBOARD_KEY);
-    XENHID_KEY( 183,    0x68,   KEYBOARD_KEY);
-    XENHID_KEY( 184,    0x69,   KEYBOARD_KEY);
-    XENHID_KEY( 185,    0x6A,   KEYBOARD_KEY);
-    XENHID_KEY( 186,    0x6B,   KEYBOARD_KEY);
-    XENHID_KEY( 187,    0x6C,   KEYBOARD_KEY);
-    XENHID_KEY( 188,    0x6D,   KEYBOARD_KEY);
-    XENHID_KEY( 189,    0x6E,   KEYBOARD_KEY);
-    XENHID_KEY( 190,    0x6F,   KEYBOARD_KEY);
-    XENHID_KEY( 191,    0x70,   KEYBOARD_KEY);
-    XENHID_KEY( 192,    0x71,   KEYBOARD_KEY);
-    XENHID_KEY( 193,    0x72,   KEYBOARD_KEY);
-    XENHID_KEY( 194,    0x73,   KEYBOARD_KEY);
-        // KEYBOARD MODIFIERS
-    XENHID_KEY( 0xE0,   0x01,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE1,   0x02,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE2,   0x04,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE3,   0x08,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE4,   0x10,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE5,   0x20,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE6,   0x40,   KEYBOARD_MODIFIER);
-    XENHID_KEY( 0xE7,   0x80,   KEYBOARD_MODIFIER);
-        // MOUSE
-    XENHID_KEY( 0x110,  0x01,   MOUSE_BUTTON);
-    XENHID_KEY( 0x111,  0x02,   MOUSE_BUTTON);
-    XENHID_KEY( 0x112,  0x04,   MOUSE_BUTTON);
-    XENHID_KEY( 0x113,  0x08,   MOUSE_BUTTON);
-    XENHID_KEY( 0x114,  0x10,   MOUSE_BUTTON);
-
-    default:    return 0;
-    }
-
-#undef XENHID_KEY
+    if (Code >= VKBD_KEYMAP_SIZE)
+        return 0;
+
+    *Value = Vkbd->Keymap[Code].Value;
+    return Vkbd->Keymap[Code].Type;
 }
 
 static FORCEINLINE BOOLEAN
+__TestBit(
+    IN  UCHAR               Bits,
+    IN  UCHAR               Bit,
+    IN  UCHAR               Pressed
+    )
+{
+    if (Pressed)
+        return (Bits & Bit) == 0;
+    else
+        return (Bits & Bit) != 0;
+}
+
+static FORCEINLINE VOID
 __UpdateBit(
     IN  PUCHAR              Bits,
     IN  UCHAR               Bit,
     IN  UCHAR               Pressed
     )
 {
-    if (Pressed) {
-        if (*Bits & Bit)
-            return FALSE; // no change
+    if (Pressed)
         *Bits |= Bit;
-        return TRUE;
-    } else {
-        if ((*Bits & Bit) == 0)
-            return FALSE; // no change
+    else
         *Bits &= ~Bit;
-        return TRUE;
-    }
 }
 
 static FORCEINLINE BOOLEAN
+__TestArray(
+    IN  PUCHAR              Array,
+    IN  ULONG               Size,
+    IN  UCHAR               Value,
+    IN  UCHAR               Pressed
+    )
+{
+    ULONG   Index;
+
+    for (Index = 0; Index < Size; ++Index) {
+        if (Array[Index] == Value)
+            return !Pressed;
+    }
+    return Pressed ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
 __UpdateArray(
     IN  PUCHAR              Array,
     IN  ULONG               Size,
@@ -334,15 +352,12 @@ __UpdateArray(
     ULONG   Index;
     if (Pressed) {
         for (Index = 0; Index < Size; ++Index) {
-            if (Array[Index] == Value)
-                return FALSE; // no change
             if (Array[Index] == 0) {
                 Array[Index] = Value;
-                return TRUE;
+                return;
             }
         }
         Array[Size - 1] = Value;
-        return TRUE;
     } else {
         for (Index = 0; Index < Size; ++Index) {
             if (Array[Index] == Value) {
@@ -350,62 +365,575 @@ __UpdateArray(
                     Array[Index] = Array[Index + 1];
                 }
                 Array[Size - 1] = 0;
-                return TRUE;
+                return;
             }
         }
-        return FALSE; // no change
     }
 }
 
+static FORCEINLINE ULONGLONG
+__Microseconds(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONGLONG           Ticks
+    )
+{
+    // split to avoid overflowing the multiply
+    return ((Ticks / Vkbd->Frequency) * 1000000ull) +
+           (((Ticks % Vkbd->Frequency) * 1000000ull) / Vkbd->Frequency);
+}
+
+static FORCEINLINE ULONGLONG
+__Now(
+    VOID
+    )
+{
+    return (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
 static FORCEINLINE VOID
-__Complete(
-    IN  PXENHID_FDO         Fdo,
-    IN  PBOOLEAN            Pending,
+__Record(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  VKBD_STAGE          Stage,
+    IN  ULONGLONG           Microseconds
+    )
+{
+    ULONG   Bucket = 0;
+
+    // bucket N holds [2^N, 2^(N+1)) us, bucket 0 anything under 2us
+    while (Microseconds > 1 && Bucket < VKBD_HISTOGRAM_BUCKETS - 1) {
+        Microseconds >>= 1;
+        ++Bucket;
+    }
+
+    ++Vkbd->Histogram[Stage][Bucket];
+}
+
+static FORCEINLINE VOID
+__RecordBackend(
+    IN  PXENHID_VKBD            Vkbd,
+    IN  union xenkbd_in_event*  Event
+    )
+{
+    ULONGLONG   Stamp;
+    LONGLONG    Delta;
+
+    Stamp = *(ULONGLONG*)((PUCHAR)Event + VKBD_TIMESTAMP_OFFSET);
+    if (Stamp == 0)
+        return;
+
+    // The clocks differ by an unknown offset, so take the smallest
+    // difference seen as zero latency and report relative to that.
+    // MinBackendDelta starts at MAXLONGLONG (none seen yet): zero and
+    // negative differences are real values.
+    Delta = (LONGLONG)__Microseconds(Vkbd, Vkbd->DpcStamp) - (LONGLONG)(Stamp / 1000ull);
+    if (Delta < Vkbd->MinBackendDelta)
+        Vkbd->MinBackendDelta = Delta;
+
+    __Record(Vkbd, VKBD_STAGE_BACKEND, (ULONGLONG)(Delta - Vkbd->MinBackendDelta));
+}
+
+static FORCEINLINE BOOLEAN
+__Emit(
+    IN  PXENHID_VKBD        Vkbd,
     IN  PVOID               Buffer,
     IN  ULONG               Length
     )
 {
     NTSTATUS    status;
 
-    status = FdoCompleteRead(Fdo, Buffer, Length);
+    status = FdoCompleteRead(FrontendGetFdo(Vkbd->Frontend), Buffer, Length);
     if (!NT_SUCCESS(status))
-        *Pending = TRUE;
+        return FALSE;
+
+    ++Vkbd->NumReports;
+
+    if (Vkbd->Timestamps)
+        __Record(Vkbd, VKBD_STAGE_REPORT, __Microseconds(Vkbd, __Now() - Vkbd->DpcStamp));
+
+    return TRUE;
+}
+
+// Deliver queued keyboard reports, oldest first. TRUE if none are left.
+static BOOLEAN
+__DrainKeyFifo(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    while (Vkbd->KeyFifoHead != Vkbd->KeyFifoTail) {
+        ULONG   Index = Vkbd->KeyFifoHead & (VKBD_KEY_FIFO_LENGTH - 1);
+
+        if (!__Emit(Vkbd, &Vkbd->KeyFifo[Index], Vkbd->KeyLength))
+            return FALSE;
+
+        ++Vkbd->KeyFifoHead;
+    }
+
+    return TRUE;
+}
+
+// Note when a pointer report first had to wait, for the bound below
+static FORCEINLINE VOID
+__PointerHeld(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONGLONG           Now
+    )
+{
+    if (Vkbd->PointerWaiting == 0)
+        Vkbd->PointerWaiting = Now;
+}
+
+// Motion alone cannot be misordered with keyboard reports, so once it
+// has waited PointerBound behind them it is allowed to go first (with
+// no bound, it never waits). The clock is only read while it waits.
+static FORCEINLINE BOOLEAN
+__PointerOverdue(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Batch
+    )
+{
+    if (Batch & ~VKBD_BATCH_MOTION)
+        return FALSE;
+
+    if (Vkbd->PointerBound == 0)
+        return TRUE;
+
+    if (Vkbd->PointerWaiting == 0)
+        return FALSE;
+
+    return (__Now() - Vkbd->PointerWaiting >= Vkbd->PointerBound) ? TRUE : FALSE;
+}
+
+// Try to emit a pointer batch. Pointer reports coalesce: if nobody is
+// reading (or keyboard reports are still queued ahead of it) the batch,
+// and the state it covers, is kept and later events fold into it.
+// FALSE means that state must not be overwritten, i.e. the caller has
+// to stall.
+static FORCEINLINE BOOLEAN
+__Flush(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  PULONG              Batch,
+    IN  PVOID               Buffer,
+    IN  ULONG               Length
+    )
+{
+    if (*Batch == 0)
+        return TRUE;
+
+    // The clock is read only for what shaping and the bound need, so
+    // with both off a flush reads none
+    if (__PointerOverdue(Vkbd, *Batch)) {
+        if (!__Emit(Vkbd, Buffer, Length))
+            return !Vkbd->FlowControl;
+
+        if (Vkbd->KeyFifoHead != Vkbd->KeyFifoTail)
+            ++Vkbd->NumBypassed;
+    } else if (!__DrainKeyFifo(Vkbd) ||
+               !__Emit(Vkbd, Buffer, Length)) {
+        if (Vkbd->PointerBound != 0 && Vkbd->PointerWaiting == 0)
+            __PointerHeld(Vkbd, __Now());
+        return !Vkbd->FlowControl;
+    }
+
+    *Batch = 0;
+    if (Vkbd->PointerInterval != 0)
+        Vkbd->LastPointer = __Now();
+    Vkbd->PointerWaiting = 0;
+    return TRUE;
+}
+
+// Pointer motion is reported at most once every PointerInterval; more
+// motion in between just folds into the pending report. Buttons are
+// never held back. This only applies where the DPC chooses to emit,
+// not where a report has to go to make room or keep order.
+static BOOLEAN
+__PointerShaped(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    ULONG       Batch = Vkbd->MouBatch | Vkbd->RelBatch;
+    ULONGLONG   Now;
+
+    Vkbd->PointerDue = 0;
+
+    if (Batch == 0 || (Batch & ~VKBD_BATCH_MOTION))
+        return FALSE;
+
+    if (Vkbd->PointerInterval == 0)
+        return FALSE;
+
+    Now = __Now();
+    if (Now - Vkbd->LastPointer >= Vkbd->PointerInterval)
+        return FALSE;
+
+    Vkbd->PointerDue = Vkbd->LastPointer + Vkbd->PointerInterval;
+    __PointerHeld(Vkbd, Now);
+    ++Vkbd->NumShaped;
+    return TRUE;
+}
+
+// Keyboard reports are never coalesced: one that cannot be delivered
+// now is queued behind any already waiting. Only a full FIFO leaves the
+// batch in place (and so stalls, with flow control on).
+static BOOLEAN
+__FlushKeyState(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    BOOLEAN Drained;
+    ULONG   Depth;
+
+    Drained = __DrainKeyFifo(Vkbd);
+
+    if (Vkbd->KeyBatch == 0)
+        return TRUE;
+
+    if (Drained &&
+        __Emit(Vkbd, &Vkbd->KeyState, Vkbd->KeyLength)) {
+        Vkbd->KeyBatch = 0;
+        return TRUE;
+    }
+
+    Depth = Vkbd->KeyFifoTail - Vkbd->KeyFifoHead;
+    if (Depth == VKBD_KEY_FIFO_LENGTH) {
+        ++Vkbd->NumKeyFifoFull;
+        return !Vkbd->FlowControl;
+    }
+
+    Vkbd->KeyFifo[Vkbd->KeyFifoTail & (VKBD_KEY_FIFO_LENGTH - 1)] = Vkbd->KeyState;
+    ++Vkbd->KeyFifoTail;
+    ++Vkbd->NumKeyQueued;
+
+    if (Depth + 1 > Vkbd->KeyFifoMax)
+        Vkbd->KeyFifoMax = Depth + 1;
+
+    Vkbd->KeyBatch = 0;
+    return TRUE;
+}
+
+static BOOLEAN
+__FlushMouState(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    if (Vkbd->MouBatch == 0)
+        return TRUE;
+
+    if (!__Flush(Vkbd, &Vkbd->MouBatch, &Vkbd->MouState, sizeof(XENHID_MOUSE)))
+        return FALSE;
+
+    // Z is relative; once reported it must not be reported again
+    if (Vkbd->MouBatch == 0)
+        Vkbd->MouState.Z = 0;
+    return TRUE;
+}
+
+static BOOLEAN
+__FlushRelState(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    if (Vkbd->RelBatch == 0)
+        return TRUE;
+
+    if (!__Flush(Vkbd, &Vkbd->RelBatch, &Vkbd->RelState, sizeof(XENHID_RELMOUSE)))
+        return FALSE;
+
+    // motion is relative; once reported it must not be reported again
+    if (Vkbd->RelBatch == 0) {
+        Vkbd->RelState.X = 0;
+        Vkbd->RelState.Y = 0;
+        Vkbd->RelState.Z = 0;
+    }
+    return TRUE;
+}
+
+static VOID
+__Resync(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    // Events have been lost so nothing held can be trusted: release
+    // every key and button rather than leave any of them stuck
+    Vkbd->KeyState.Modifiers = 0;
+    RtlZeroMemory(Vkbd->KeyState.Keys, sizeof(Vkbd->KeyState.Keys));
+    Vkbd->KeyBatch |= VKBD_BATCH_KEY_RELEASE;
+
+    Vkbd->MouState.Buttons = 0;
+    Vkbd->MouState.Z = 0;
+    Vkbd->MouBatch |= VKBD_BATCH_BUTTON;
+
+    Vkbd->RelState.Buttons = 0;
+    Vkbd->RelState.X = Vkbd->RelState.Y = 0;
+    Vkbd->RelState.Z = 0;
+    Vkbd->RelBatch |= VKBD_BATCH_BUTTON;
+
+    // the events are gone anyway so there is nothing to stall for
+    (VOID) __FlushKeyState(Vkbd);
+    (VOID) __FlushMouState(Vkbd);
+    (VOID) __FlushRelState(Vkbd);
 }
 
 static VOID
+__Publish(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    PVKBD_SNAPSHOT  Snapshot = &Vkbd->Snapshot;
+
+    // Single writer: the DPC, under Vkbd->Lock (or create, before it runs)
+    ASSERT(!(Snapshot->Sequence & 1));
+
+    (VOID) InterlockedIncrement(&Snapshot->Sequence);
+
+    Snapshot->KeyState = Vkbd->KeyState;
+    Snapshot->MouState = Vkbd->MouState;
+    Snapshot->RelState = Vkbd->RelState;
+
+    (VOID) InterlockedIncrement(&Snapshot->Sequence);
+}
+
+// Safe at any IRQL and from any CPU; retries while the DPC is part way
+// through publishing, which it never is for long
+static VOID
+__ReadSnapshot(
+    IN  PXENHID_VKBD        Vkbd,
+    OUT PXENHID_KEYBOARD    KeyState OPTIONAL,
+    OUT PXENHID_MOUSE       MouState OPTIONAL,
+    OUT PXENHID_RELMOUSE    RelState OPTIONAL
+    )
+{
+    PVKBD_SNAPSHOT  Snapshot = &Vkbd->Snapshot;
+    LONG            Sequence;
+
+    for (;;) {
+        Sequence = Snapshot->Sequence;
+        KeMemoryBarrier();
+
+        if (!(Sequence & 1)) {
+            if (KeyState)
+                *KeyState = Snapshot->KeyState;
+            if (MouState)
+                *MouState = Snapshot->MouState;
+            if (RelState)
+                *RelState = Snapshot->RelState;
+
+            KeMemoryBarrier();
+            if (Snapshot->Sequence == Sequence)
+                break;
+        }
+
+        (VOID) InterlockedIncrement(&Vkbd->NumSnapshotRetries);
+        YieldProcessor();
+    }
+}
+
+// Fold a transition into the current batch, emitting the batch first
+// if it holds anything that must not be reordered with the transition.
+// Returns FALSE, without touching the batch, if that emit stalled.
+static FORCEINLINE BOOLEAN
+__BatchKeyState(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Batch,
+    IN  ULONG               Allowed
+    )
+{
+    if ((Vkbd->MouBatch & VKBD_BATCH_BUTTON) && !__FlushMouState(Vkbd))
+        return FALSE;
+
+    if ((Vkbd->RelBatch & VKBD_BATCH_BUTTON) && !__FlushRelState(Vkbd))
+        return FALSE;
+
+    if ((Vkbd->KeyBatch & ~Allowed) && !__FlushKeyState(Vkbd))
+        return FALSE;
+
+    Vkbd->KeyBatch |= Batch;
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN
+__BatchMouState(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Batch,
+    IN  ULONG               Allowed
+    )
+{
+    if ((Batch & VKBD_BATCH_BUTTON) && !__FlushKeyState(Vkbd))
+        return FALSE;
+
+    // the two pointer collections are never folded across each other
+    if (!__FlushRelState(Vkbd))
+        return FALSE;
+
+    if ((Vkbd->MouBatch & ~Allowed) && !__FlushMouState(Vkbd))
+        return FALSE;
+
+    Vkbd->MouBatch |= Batch;
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN
+__BatchRelState(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Batch,
+    IN  ULONG               Allowed
+    )
+{
+    if ((Batch & VKBD_BATCH_BUTTON) && !__FlushKeyState(Vkbd))
+        return FALSE;
+
+    if (!__FlushMouState(Vkbd))
+        return FALSE;
+
+    if ((Vkbd->RelBatch & ~Allowed) && !__FlushRelState(Vkbd))
+        return FALSE;
+
+    Vkbd->RelBatch |= Batch;
+    return TRUE;
+}
+
+// Buttons follow the pointer: anything held in the old collection is
+// released there and pressed again in the new one. Carried keeps the
+// buttons in between so a stalled switch can be resumed.
+static BOOLEAN
+__SwitchPointer(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  BOOLEAN             Relative
+    )
+{
+    if (Vkbd->Relative == Relative)
+        return TRUE;
+
+    if (Relative) {
+        if (Vkbd->MouState.Buttons != 0) {
+            if (!__BatchMouState(Vkbd, VKBD_BATCH_BUTTON, 0))
+                return FALSE;
+            Vkbd->Carried = Vkbd->MouState.Buttons;
+            Vkbd->MouState.Buttons = 0;
+        }
+        if (Vkbd->Carried != 0) {
+            if (!__BatchRelState(Vkbd, VKBD_BATCH_BUTTON, 0))
+                return FALSE;
+            Vkbd->RelState.Buttons = Vkbd->Carried;
+            Vkbd->Carried = 0;
+        }
+    } else {
+        if (Vkbd->RelState.Buttons != 0) {
+            if (!__BatchRelState(Vkbd, VKBD_BATCH_BUTTON, 0))
+                return FALSE;
+            Vkbd->Carried = Vkbd->RelState.Buttons;
+            Vkbd->RelState.Buttons = 0;
+        }
+        if (Vkbd->Carried != 0) {
+            if (!__BatchMouState(Vkbd, VKBD_BATCH_BUTTON, 0))
+                return FALSE;
+            Vkbd->MouState.Buttons = Vkbd->Carried;
+            Vkbd->Carried = 0;
+        }
+    }
+
+    Vkbd->Relative = Relative;
+    return TRUE;
+}
+
+// Returns FALSE if the event could not be applied without overwriting
+// state that has yet to be reported; it must then be left on the ring.
+static BOOLEAN
 __UpdateKeyState(
     IN  PXENHID_VKBD        Vkbd,
     IN  UCHAR               Pressed,
     IN  ULONG               Code
     )
 {
+    ULONG   Type;
     UCHAR   Value;
     
-    switch (__UsasgeType(Code, &Value)) {
+    Type = __UsasgeType(Vkbd, Code, &Value);
+
+    // the bitmap has no room for the modifier usages; they have bits
+    // of their own anyway
+    if (Vkbd->Nkro && Type == KEYBOARD_KEY && Value >= VKBD_BITMAP_KEYS) {
+        Type = KEYBOARD_MODIFIER;
+        Value = (UCHAR)(1 << (Value - VKBD_BITMAP_KEYS));
+    }
+
+    switch (Type) {
     case MOUSE_BUTTON:
-        if (!__UpdateBit(&Vkbd->MouState.Buttons, Value, Pressed))
-            return; // no changes
+        // buttons go to whichever collection last moved the pointer
+        if (Vkbd->Relative) {
+            if (!__TestBit(Vkbd->RelState.Buttons, Value, Pressed))
+                return TRUE; // no changes
+
+            if (!__BatchRelState(Vkbd, VKBD_BATCH_BUTTON, VKBD_BATCH_MOTION))
+                return FALSE;
+            __UpdateBit(&Vkbd->RelState.Buttons, Value, Pressed);
+            break;
+        }
 
-        __Complete(FrontendGetFdo(Vkbd->Frontend), &Vkbd->MouPending, &Vkbd->MouState, sizeof(XENHID_MOUSE));
+        if (!__TestBit(Vkbd->MouState.Buttons, Value, Pressed))
+            return TRUE; // no changes
+
+        // a click lands where the pointer was last moved to, but
+        // any motion after it must be reported separately
+        if (!__BatchMouState(Vkbd, VKBD_BATCH_BUTTON, VKBD_BATCH_MOTION))
+            return FALSE;
+        __UpdateBit(&Vkbd->MouState.Buttons, Value, Pressed);
         break;
 
     case KEYBOARD_MODIFIER:
-        if (!__UpdateBit(&Vkbd->KeyState.Modifiers, Value, Pressed))
-            return; // no changes
-
-        __Complete(FrontendGetFdo(Vkbd->Frontend), &Vkbd->KeyPending, &Vkbd->KeyState, sizeof(XENHID_KEYBOARD));
+        if (!__TestBit(Vkbd->KeyState.Modifiers, Value, Pressed))
+            return TRUE; // no changes
+
+        if (Pressed) {
+            if (!__BatchKeyState(Vkbd, VKBD_BATCH_MODIFIER_PRESS, VKBD_BATCH_MODIFIER_PRESS))
+                return FALSE;
+        } else {
+            if (!__BatchKeyState(Vkbd, VKBD_BATCH_KEY_RELEASE, 0))
+                return FALSE;
+        }
+        __UpdateBit(&Vkbd->KeyState.Modifiers, Value, Pressed);
         break;
 
     case KEYBOARD_KEY:
-        if (!__UpdateArray(Vkbd->KeyState.Keys, 6, Value, Pressed))
-            return; // no changes
+        if (Vkbd->Nkro) {
+            PUCHAR  Bits = &Vkbd->KeyState.Keys[Value / 8];
+            UCHAR   Bit = (UCHAR)(1 << (Value % 8));
+
+            if (!__TestBit(*Bits, Bit, Pressed))
+                return TRUE; // no changes
+
+            if (Pressed) {
+                if (!__BatchKeyState(Vkbd, VKBD_BATCH_KEY_PRESS, VKBD_BATCH_MODIFIER_PRESS | VKBD_BATCH_KEY_PRESS))
+                    return FALSE;
+            } else {
+                if (!__BatchKeyState(Vkbd, VKBD_BATCH_KEY_RELEASE, 0))
+                    return FALSE;
+            }
+            __UpdateBit(Bits, Bit, Pressed);
+            break;
+        }
+
+        if (!__TestArray(Vkbd->KeyState.Keys, VKBD_ARRAY_KEYS, Value, Pressed))
+            return TRUE; // no changes
 
-        __Complete(FrontendGetFdo(Vkbd->Frontend), &Vkbd->KeyPending, &Vkbd->KeyState, sizeof(XENHID_KEYBOARD));
+        // don't let a 7th key overwrite a press that was never reported
+        if (Pressed && Vkbd->KeyState.Keys[VKBD_ARRAY_KEYS - 1] != 0 && !__FlushKeyState(Vkbd))
+            return FALSE;
+
+        if (Pressed) {
+            if (!__BatchKeyState(Vkbd, VKBD_BATCH_KEY_PRESS, VKBD_BATCH_MODIFIER_PRESS | VKBD_BATCH_KEY_PRESS))
+                return FALSE;
+        } else {
+            if (!__BatchKeyState(Vkbd, VKBD_BATCH_KEY_RELEASE, 0))
+                return FALSE;
+        }
+        __UpdateArray(Vkbd->KeyState.Keys, VKBD_ARRAY_KEYS, Value, Pressed);
         break;
 
     default:
         break;
     }
+
+    return TRUE;
 }
 
 static FORCEINLINE LONG
@@ -420,7 +948,7 @@ __Limit(
                     return Val;
 }
 
-static VOID
+static BOOLEAN
 __UpdateMouState(
     IN  PXENHID_VKBD        Vkbd,
     IN  LONG                X,
@@ -428,26 +956,116 @@ __UpdateMouState(
     IN  LONG                Z
     )
 {
-    NTSTATUS    status;
     USHORT      x = (USHORT)__Limit(X, 0, 32767);
     USHORT      y = (USHORT)__Limit(Y, 0, 32767);
-    CHAR        z = (CHAR)  __Limit(Z, -127, 127);
+    LONG        z = __Limit(Z, -127, 127);
 
     if (x == Vkbd->MouState.X &&
         y == Vkbd->MouState.Y &&
-        z == Vkbd->MouState.Z)
-        return; // no changes
+        z == 0)
+        return TRUE; // no changes
+
+    if (!__SwitchPointer(Vkbd, FALSE))
+        return FALSE;
+
+    // wheel movement accumulates until it no longer fits in a report
+    if (__Limit(Vkbd->MouState.Z + z, -127, 127) != Vkbd->MouState.Z + z &&
+        !__FlushMouState(Vkbd))
+        return FALSE;
+
+    if (!__BatchMouState(Vkbd, VKBD_BATCH_MOTION, VKBD_BATCH_MOTION))
+        return FALSE;
 
     Vkbd->MouState.X = x;
     Vkbd->MouState.Y = y;
-    Vkbd->MouState.Z = z;
+    Vkbd->MouState.Z = (CHAR)__Limit(Vkbd->MouState.Z + z, -127, 127);
+    return TRUE;
+}
 
-    status = FdoCompleteRead(FrontendGetFdo(Vkbd->Frontend), &Vkbd->MouState, sizeof(XENHID_MOUSE));
-    if (!NT_SUCCESS(status))
-        Vkbd->MouPending = TRUE;
+// Add as much of *Delta to Value as fits, leaving the rest in *Delta
+static FORCEINLINE LONG
+__Accumulate(
+    IN      LONG            Value,
+    IN OUT  PLONG           Delta,
+    IN      LONG            Limit
+    )
+{
+    LONG    Room;
+
+    if (*Delta > 0) {
+        Room = Limit - Value;
+        if (*Delta <= Room)
+            Room = *Delta;
+    } else {
+        Room = -Limit - Value;
+        if (*Delta >= Room)
+            Room = *Delta;
+    }
+
+    *Delta -= Room;
+    return Value + Room;
 }
 
-static VOID
+static FORCEINLINE BOOLEAN
+__Fits(
+    IN  LONG                Value,
+    IN  LONG                Delta,
+    IN  LONG                Limit
+    )
+{
+    LONG    Sum = Value + __Limit(Delta, -2 * Limit, 2 * Limit);
+
+    return (Sum >= -Limit && Sum <= Limit) ? TRUE : FALSE;
+}
+
+static BOOLEAN
+__UpdateRelState(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  LONG                X,
+    IN  LONG                Y,
+    IN  LONG                Z
+    )
+{
+    if (X == 0 && Y == 0 && Z == 0)
+        return TRUE; // no changes
+
+    if (!__SwitchPointer(Vkbd, TRUE))
+        return FALSE;
+
+    // start a new report if this motion won't fit in the current one
+    if ((!__Fits(Vkbd->RelState.X, X, 32767) ||
+         !__Fits(Vkbd->RelState.Y, Y, 32767) ||
+         !__Fits(Vkbd->RelState.Z, Z, 127)) &&
+        !__FlushRelState(Vkbd))
+        return FALSE;
+
+    if (!__BatchRelState(Vkbd, VKBD_BATCH_MOTION, VKBD_BATCH_MOTION))
+        return FALSE;
+
+    // motion accumulates until it no longer fits in a report, and
+    // whatever does not fit is carried into the next one
+    for (;;) {
+        Vkbd->RelState.X = (SHORT)__Accumulate(Vkbd->RelState.X, &X, 32767);
+        Vkbd->RelState.Y = (SHORT)__Accumulate(Vkbd->RelState.Y, &Y, 32767);
+        Vkbd->RelState.Z = (CHAR)__Accumulate(Vkbd->RelState.Z, &Z, 127);
+
+        if (X == 0 && Y == 0 && Z == 0)
+            break;
+
+        (VOID) __FlushRelState(Vkbd);
+
+        // a single event bigger than a whole report, and nobody
+        // reading: the report cannot be emptied so drop the excess
+        if (Vkbd->RelBatch != 0)
+            break;
+
+        Vkbd->RelBatch |= VKBD_BATCH_MOTION;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
 VkbdEvent(
     IN  PXENHID_VKBD        Vkbd,
     IN  union xenkbd_in_event*  Event
@@ -455,25 +1073,82 @@ VkbdEvent(
 {
     switch (Event->type) {
     case XENKBD_TYPE_KEY:
-        __UpdateKeyState(Vkbd, Event->key.pressed, Event->key.keycode);
-        break;
+        return __UpdateKeyState(Vkbd, Event->key.pressed, Event->key.keycode);
     case XENKBD_TYPE_POS:
-        __UpdateMouState(Vkbd, Event->pos.abs_x, Event->pos.abs_y, Event->pos.rel_z);
-        break;
+        return __UpdateMouState(Vkbd, Event->pos.abs_x, Event->pos.abs_y, Event->pos.rel_z);
+    case XENKBD_TYPE_MOTION:
+        return __UpdateRelState(Vkbd, Event->motion.rel_x, Event->motion.rel_y, Event->motion.rel_z);
     default:
-        break;
+        return TRUE;
     }
 }
 
-static VOID
+static FORCEINLINE union xenkbd_in_event*
+__InEvent(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Index
+    )
+{
+    if (!Vkbd->Extended)
+        return &XENKBD_IN_RING_REF(Vkbd->Shared, Index);
+
+    return &Vkbd->InRing[Index & (Vkbd->InRingLen - 1)];
+}
+
+// Sampling the clock is not free, so only do it every few events
+#define VKBD_TIME_CHECK_INTERVAL    16
+
+static FORCEINLINE BOOLEAN
+__OverBudget(
+    IN  PXENHID_VKBD        Vkbd,
+    IN  ULONG               Count,
+    IN  ULONGLONG           Start
+    )
+{
+    if (Vkbd->EventBudget != 0 && Count >= Vkbd->EventBudget)
+        return TRUE;
+
+    if (Vkbd->TimeBudget != 0 &&
+        (Count % VKBD_TIME_CHECK_INTERVAL) == 0 &&
+        (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart - Start >= Vkbd->TimeBudget)
+        return TRUE;
+
+    return FALSE;
+}
+
+static ULONG
 VkbdPoll(
-    IN  PXENHID_VKBD        Vkbd
+    IN  PXENHID_VKBD        Vkbd,
+    OUT PBOOLEAN            Exhausted,
+    OUT PBOOLEAN            Stalled
     )
 {
+    ULONG       Count = 0;
+    ULONGLONG   Start;
+
+    *Exhausted = FALSE;
+    *Stalled = FALSE;
+    Start = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    // retry anything that could not be emitted last time, keyboard
+    // first and pointer motion only once it is due
+    if (!__FlushKeyState(Vkbd) ||
+        (!__PointerShaped(Vkbd) &&
+         (!__FlushMouState(Vkbd) ||
+          !__FlushRelState(Vkbd)))) {
+        *Stalled = TRUE;
+        return 0;
+    }
+
     for (;;) {
         ULONG   Cons;
         ULONG   Prod;
 
+        if (Count != 0 && __OverBudget(Vkbd, Count, Start)) {
+            *Exhausted = TRUE;
+            break;
+        }
+
         KeMemoryBarrier();
 
         Cons = Vkbd->Shared->in_cons;
@@ -484,19 +1159,90 @@ VkbdPoll(
         if (Cons == Prod)
             break;
 
+        // The backend can never be more than a ring ahead; if it
+        // claims to be, the slots cannot be trusted so skip them all
+        if (Prod - Cons > Vkbd->InRingLen) {
+            ++Vkbd->NumOverruns;
+            Vkbd->NumDropped += Prod - Cons;
+
+            Warning("overrun: cons %u prod %u\n", Cons, Prod);
+
+            __Resync(Vkbd);
+
+            KeMemoryBarrier();
+
+            Vkbd->Shared->in_cons = Prod;
+
+            // charge it against the budget so a backend that keeps
+            // doing this cannot hold us here
+            ++Count;
+            continue;
+        }
+
+        // decode the whole window, folding it into as few
+        // reports as ordering allows, then emit what is left
         while (Cons != Prod) {
             union xenkbd_in_event*  evt;
 
-            evt = &XENKBD_IN_RING_REF(Vkbd->Shared, Cons);
+            evt = __InEvent(Vkbd, Cons);
+
+            // leave it on the ring until there is a read to take
+            // the state it would overwrite
+            if (!VkbdEvent(Vkbd, evt)) {
+                *Stalled = TRUE;
+                break;
+            }
+
+            if (Vkbd->BackendTimestamps)
+                __RecordBackend(Vkbd, evt);
+
             ++Cons;
+            ++Vkbd->NumConsumed;
+            ++Count;
+
+            // stop part way through the window if out of budget; the
+            // rest is picked up by the re-queued DPC
+            if (__OverBudget(Vkbd, Count, Start))
+                break;
+        }
 
-            VkbdEvent(Vkbd, evt);
+        (VOID) __FlushKeyState(Vkbd);
+        if (!__PointerShaped(Vkbd)) {
+            (VOID) __FlushMouState(Vkbd);
+            (VOID) __FlushRelState(Vkbd);
         }
 
         KeMemoryBarrier();
 
         Vkbd->Shared->in_cons = Cons;
+
+        if (*Stalled)
+            break;
     }
+
+    if (Count != 0)
+        __Publish(Vkbd);
+
+    return Count;
+}
+
+static VOID
+VkbdUnmask(
+    IN  PXENHID_VKBD        Vkbd
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+
+    Vkbd->Polling = FALSE;
+
+    (VOID) EVTCHN(Unmask, FdoEvtchnInterface(Fdo), Vkbd->Evtchn, FALSE);
+
+    // Anything produced while we were masked raised no interrupt,
+    // so the ring must be found empty after re-arming
+    KeMemoryBarrier();
+
+    if (Vkbd->Shared->in_prod != Vkbd->Shared->in_cons)
+        (VOID) KeInsertQueueDpc(&Vkbd->Dpc, NULL, NULL);
 }
 
 KDEFERRED_ROUTINE VkbdDpc;
@@ -510,12 +1256,146 @@ VkbdDpc(
     )
 {
     PXENHID_VKBD    Vkbd = Context;
+    ULONG           Count;
+    BOOLEAN         Exhausted;
+    BOOLEAN         Stalled;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    if (!Vkbd->Connected)
+        return;
+
+    // The DPC is queued by reads as well as interrupts and timers so
+    // may be running on another processor
+    KeAcquireSpinLockAtDpcLevel(&Vkbd->Lock);
+
+    if (Vkbd->Timestamps) {
+        ULONGLONG   Interrupt = Vkbd->InterruptStamp;
+
+        Vkbd->DpcStamp = __Now();
+        if (Interrupt != 0) {
+            Vkbd->InterruptStamp = 0;
+            __Record(Vkbd, VKBD_STAGE_INTERRUPT, __Microseconds(Vkbd, Vkbd->DpcStamp - Interrupt));
+        }
+    }
+
+    Count = VkbdPoll(Vkbd, &Exhausted, &Stalled);
+
+    if (Vkbd->Polling) {
+        ++Vkbd->NumPolls;
+        if (Count != 0)
+            ++Vkbd->NumMitigated;
+    }
+
+    if (Stalled) {
+        // Nothing can be consumed until hidclass posts another read,
+        // which re-queues this DPC. Until then the channel is left
+        // masked; the ring fills and the backend holds off.
+        if (!Vkbd->Stalled)
+            ++Vkbd->NumStalls;
+        Vkbd->Stalled = TRUE;
+        Vkbd->Polling = FALSE;
+        goto done;
+    }
+    Vkbd->Stalled = FALSE;
+
+    if (Count == 0) {
+        // Idle: go back to interrupt mode
+        VkbdUnmask(Vkbd);
+
+        // but come back for pointer motion held back by shaping,
+        // even if nothing else arrives in the meantime
+        if (Vkbd->PointerDue != 0) {
+            LARGE_INTEGER   Timeout;
+            ULONGLONG       Now = __Now();
+
+            Timeout.QuadPart = -1;
+            if (Vkbd->PointerDue > Now)
+                Timeout.QuadPart = -10ll * (LONGLONG)__Microseconds(Vkbd, Vkbd->PointerDue - Now) - 1;
+
+            (VOID) KeSetTimer(&Vkbd->Timer, Timeout, &Vkbd->Dpc);
+        }
+        goto done;
+    }
+
+    // Busy: the channel stays masked (it is masked on every upcall)
+    // and the ring is polled again until a pass finds it empty
+    Vkbd->Polling = TRUE;
+
+    if (Exhausted) {
+        // Out of budget with work left: give other DPCs on this
+        // processor a turn, but don't wait any poll interval
+        ++Vkbd->NumExhausted;
+        (VOID) KeInsertQueueDpc(&Vkbd->Dpc, NULL, NULL);
+    } else if (Vkbd->PollInterval.QuadPart == 0)
+        (VOID) KeInsertQueueDpc(&Vkbd->Dpc, NULL, NULL);
+    else
+        (VOID) KeSetTimer(&Vkbd->Timer, Vkbd->PollInterval, &Vkbd->Dpc);
+
+done:
+    KeReleaseSpinLockFromDpcLevel(&Vkbd->Lock);
+}
+
+KDEFERRED_ROUTINE VkbdOutDpc;
+
+VOID
+VkbdOutDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENHID_VKBD            Vkbd = Context;
+    PXENHID_FDO             Fdo;
+    struct vkbd_out_leds*   Event;
+    ULONG                   Prod;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
     UNREFERENCED_PARAMETER(Argument2);
 
-    VkbdPoll(Vkbd);
+    Fdo = FrontendGetFdo(Vkbd->Frontend);
+
+    KeAcquireSpinLockAtDpcLevel(&Vkbd->OutLock);
+
+    // checked under the lock, which Vkbd_Resume() takes to swap the ring
+    // and event channel from under us
+    if (!Vkbd->Connected)
+        goto done;
+
+    // LED state is a level, so every write since the last run is
+    // covered by a single event carrying the latest state
+    if (Vkbd->Leds == Vkbd->LedsSent)
+        goto done;
+
+    Prod = Vkbd->Shared->out_prod;
+    KeMemoryBarrier();
+
+    if (Prod - Vkbd->Shared->out_cons >= XENKBD_OUT_RING_LEN) {
+        // the next write will try again
+        ++Vkbd->NumOutFull;
+        goto done;
+    }
+
+    Event = (struct vkbd_out_leds*)&XENKBD_OUT_RING_REF(Vkbd->Shared, Prod);
+    RtlZeroMemory(Event, XENKBD_OUT_EVENT_SIZE);
+    Event->type = VKBD_OUT_TYPE_LEDS;
+    Event->leds = Vkbd->Leds;
+
+    KeMemoryBarrier();
+
+    Vkbd->Shared->out_prod = Prod + 1;
+    Vkbd->LedsSent = Vkbd->Leds;
+    ++Vkbd->NumLedEvents;
+
+    (VOID) EVTCHN(Send, FdoEvtchnInterface(Fdo), Vkbd->Evtchn);
+    ++Vkbd->NumOutNotifies;
+
+done:
+    KeReleaseSpinLockFromDpcLevel(&Vkbd->OutLock);
 }
 
 KSERVICE_ROUTINE    VkbdInterrupt;
@@ -531,6 +1411,11 @@ VkbdInterrupt(
     UNREFERENCED_PARAMETER(Interrupt);
 
     ++Vkbd->NumInts;
+
+    // the first interrupt since the DPC last ran is the one it serves
+    if (Vkbd->Timestamps && Vkbd->InterruptStamp == 0)
+        Vkbd->InterruptStamp = __Now();
+
     if (KeInsertQueueDpc(&Vkbd->Dpc, NULL, NULL))
         ++Vkbd->NumEvts;
 
@@ -545,6 +1430,7 @@ Vkbd_Create(
 {
     NTSTATUS        status;
     PXENHID_VKBD    Vkbd;
+    LARGE_INTEGER   Frequency;
 
     Trace("====>\n");
 
@@ -556,7 +1442,41 @@ Vkbd_Create(
     Vkbd->Frontend = Frontend;
     Vkbd->KeyState.ReportId = 1;
     Vkbd->MouState.ReportId = 2;
+    Vkbd->RelState.ReportId = 3;
+    __Publish(Vkbd);
+    KeInitializeSpinLock(&Vkbd->Lock);
     KeInitializeDpc(&Vkbd->Dpc, VkbdDpc, Vkbd);
+    KeInitializeSpinLock(&Vkbd->OutLock);
+    KeInitializeDpc(&Vkbd->OutDpc, VkbdOutDpc, Vkbd);
+    KeInitializeTimer(&Vkbd->Timer);
+
+    Vkbd->FlowControl = DriverGetParameters()->FlowControl ? TRUE : FALSE;
+
+    // fixed for the life of the device: it decides the report descriptor
+    Vkbd->Nkro = DriverGetParameters()->Nkro ? TRUE : FALSE;
+    RtlCopyMemory(Vkbd->Keymap, VkbdKeymap, sizeof(Vkbd->Keymap));
+    Vkbd->KeyLength = FIELD_OFFSET(XENHID_KEYBOARD, Keys) +
+                      (Vkbd->Nkro ? VKBD_BITMAP_KEYS / 8 : VKBD_ARRAY_KEYS);
+
+    // relative due time, in 100ns units
+    Vkbd->PollInterval.QuadPart = -10ll * DriverGetParameters()->PollInterval;
+
+    Vkbd->EventBudget = DriverGetParameters()->DpcEventBudget;
+
+    // convert to performance counter ticks
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+    Vkbd->TimeBudget = ((ULONGLONG)DriverGetParameters()->DpcTimeBudget *
+                        (ULONGLONG)Frequency.QuadPart) / 1000000ull;
+    Vkbd->Frequency = (ULONGLONG)Frequency.QuadPart;
+
+    Vkbd->PointerInterval = ((ULONGLONG)DriverGetParameters()->PointerInterval *
+                             (ULONGLONG)Frequency.QuadPart) / 1000000ull;
+    Vkbd->PointerBound = ((ULONGLONG)DriverGetParameters()->PointerBound *
+                          (ULONGLONG)Frequency.QuadPart) / 1000000ull;
+
+    // motion is never held back by shaping for longer than the bound
+    if (Vkbd->PointerBound < Vkbd->PointerInterval)
+        Vkbd->PointerInterval = Vkbd->PointerBound;
 
     *Context = (PXENHID_CONTEXT)Vkbd;
 
@@ -580,8 +1500,50 @@ Vkbd_Destroy(
     Vkbd->Frontend = NULL;
     RtlZeroMemory(&Vkbd->KeyState, sizeof(XENHID_KEYBOARD));
     RtlZeroMemory(&Vkbd->MouState, sizeof(XENHID_MOUSE));
+    RtlZeroMemory(&Vkbd->RelState, sizeof(XENHID_RELMOUSE));
     RtlZeroMemory(&Vkbd->Dpc, sizeof(KDPC));
+    RtlZeroMemory(&Vkbd->Timer, sizeof(KTIMER));
+    Vkbd->PollInterval.QuadPart = 0;
+    Vkbd->EventBudget = 0;
+    Vkbd->TimeBudget = 0;
     Vkbd->NumInts = Vkbd->NumEvts = 0;
+    Vkbd->NumPolls = Vkbd->NumMitigated = 0;
+    Vkbd->NumExhausted = 0;
+    Vkbd->NumConsumed = Vkbd->NumReports = 0;
+    Vkbd->NumOverruns = Vkbd->NumDropped = 0;
+    Vkbd->KeyBatch = Vkbd->MouBatch = Vkbd->RelBatch = 0;
+    RtlZeroMemory(&Vkbd->Snapshot, sizeof(VKBD_SNAPSHOT));
+    Vkbd->NumSnapshotRetries = 0;
+    RtlZeroMemory(Vkbd->KeyFifo, sizeof(Vkbd->KeyFifo));
+    Vkbd->KeyFifoHead = Vkbd->KeyFifoTail = 0;
+    Vkbd->KeyFifoMax = 0;
+    Vkbd->NumKeyQueued = Vkbd->NumKeyFifoFull = 0;
+    Vkbd->AbsPointer = Vkbd->Relative = FALSE;
+    Vkbd->Nkro = FALSE;
+    Vkbd->KeyLength = 0;
+    RtlZeroMemory(Vkbd->Keymap, sizeof(Vkbd->Keymap));
+    Vkbd->NumOverrides = 0;
+    Vkbd->Carried = 0;
+    Vkbd->Extended = FALSE;
+    Vkbd->InRingOrder = 0;
+    Vkbd->FlowControl = Vkbd->Stalled = FALSE;
+    Vkbd->NumStalls = 0;
+    Vkbd->PointerInterval = Vkbd->PointerBound = 0;
+    Vkbd->LastPointer = Vkbd->PointerWaiting = 0;
+    Vkbd->PointerDue = 0;
+    Vkbd->NumShaped = Vkbd->NumBypassed = 0;
+    Vkbd->FeatureLeds = FALSE;
+    RtlZeroMemory(&Vkbd->OutLock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Vkbd->OutDpc, sizeof(KDPC));
+    Vkbd->Leds = Vkbd->LedsSent = 0;
+    Vkbd->NumLedWrites = Vkbd->NumLedEvents = 0;
+    Vkbd->NumOutNotifies = Vkbd->NumOutFull = 0;
+    Vkbd->Timestamps = Vkbd->BackendTimestamps = FALSE;
+    Vkbd->Frequency = 0;
+    Vkbd->InterruptStamp = Vkbd->DpcStamp = 0;
+    Vkbd->MinBackendDelta = 0;
+    RtlZeroMemory(Vkbd->Histogram, sizeof(Vkbd->Histogram));
+    RtlZeroMemory(&Vkbd->Lock, sizeof(KSPIN_LOCK));
 
     ASSERT(IsZeroMemory(Context, sizeof(XENHID_VKBD)));
     __VkbdFree(Context);
@@ -597,6 +1559,221 @@ __Pfn(
     return (PFN_NUMBER)(ULONG_PTR)(MmGetPhysicalAddress(Buffer).QuadPart >> PAGE_SHIFT);
 }
 
+static const struct {
+    const CHAR* Name;
+    UCHAR       Type;
+} VkbdKeymapType[] = {
+    { "key",        KEYBOARD_KEY },
+    { "modifier",   KEYBOARD_MODIFIER },
+    { "button",     MOUSE_BUTTON },
+    { "none",       0 }
+};
+
+// One override: <code>=<type>[:<value>], codes and values in C syntax,
+// e.g. "86=key:0x64" or "0x114=none"
+static BOOLEAN
+__VkbdParseOverride(
+    IN  PXENHID_VKBD                Vkbd,
+    IN  PCHAR                       Entry
+    )
+{
+    PCHAR   End;
+    ULONG   Code;
+    ULONG   Value;
+    ULONG   Index;
+    size_t  Length;
+
+    Code = strtoul(Entry, &End, 0);
+    if (End == Entry || *End != '=' || Code >= VKBD_KEYMAP_SIZE)
+        return FALSE;
+    Entry = End + 1;
+
+    for (Index = 0; Index < ARRAYSIZE(VkbdKeymapType); ++Index) {
+        Length = strlen(VkbdKeymapType[Index].Name);
+        if (strncmp(Entry, VkbdKeymapType[Index].Name, Length) == 0)
+            break;
+    }
+    if (Index == ARRAYSIZE(VkbdKeymapType))
+        return FALSE;
+    Entry += Length;
+
+    Value = 0;
+    if (VkbdKeymapType[Index].Type != 0) {
+        if (*Entry++ != ':')
+            return FALSE;
+
+        Value = strtoul(Entry, &End, 0);
+        if (End == Entry || Value == 0 || Value > 0xFF)
+            return FALSE;
+        Entry = End;
+    }
+
+    if (*Entry != '\0')
+        return FALSE;
+
+    // modifiers and buttons are bit masks, one bit per usage
+    if ((VkbdKeymapType[Index].Type == KEYBOARD_MODIFIER ||
+         VkbdKeymapType[Index].Type == MOUSE_BUTTON) &&
+        (Value & (Value - 1)) != 0) {
+        Warning("keymap: %s 0x%x is not a single bit\n",
+                VkbdKeymapType[Index].Name, Value);
+        return FALSE;
+    }
+
+    // the NKRO bitmap stops at VKBD_BITMAP_KEYS, and only the eight
+    // usages after it have modifier bits to stand in for them
+    if (Vkbd->Nkro &&
+        VkbdKeymapType[Index].Type == KEYBOARD_KEY &&
+        Value >= VKBD_BITMAP_KEYS + 8) {
+        Warning("keymap: key 0x%x is outside the NKRO report\n", Value);
+        return FALSE;
+    }
+
+    Vkbd->Keymap[Code].Type = VkbdKeymapType[Index].Type;
+    Vkbd->Keymap[Code].Value = (UCHAR)Value;
+    return TRUE;
+}
+
+// The built-in table, with any overrides the toolstack has put in the
+// frontend's "keymap" key (space separated) applied on top. Lookups
+// stay a single load whatever the number of overrides.
+static VOID
+__VkbdLoadKeymap(
+    IN  PXENHID_VKBD                Vkbd
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    PCHAR           Buffer;
+    PCHAR           Entry;
+    PCHAR           Cursor;
+    NTSTATUS        status;
+
+    RtlCopyMemory(Vkbd->Keymap, VkbdKeymap, sizeof(Vkbd->Keymap));
+    Vkbd->NumOverrides = 0;
+
+    status = STORE(Read,
+                    FdoStoreInterface(Fdo),
+                    NULL,
+                    FdoGetStorePath(Fdo),
+                    "keymap",
+                    &Buffer);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Cursor = Buffer;
+    for (;;) {
+        while (*Cursor == ' ')
+            ++Cursor;
+        if (*Cursor == '\0')
+            break;
+
+        Entry = Cursor;
+        while (*Cursor != ' ' && *Cursor != '\0')
+            ++Cursor;
+        if (*Cursor == ' ')
+            *Cursor++ = '\0';
+
+        if (__VkbdParseOverride(Vkbd, Entry))
+            ++Vkbd->NumOverrides;
+        else
+            Warning("keymap: ignoring '%s'\n", Entry);
+    }
+
+    STORE(Free, FdoStoreInterface(Fdo), Buffer);
+
+    Info("keymap: %u overrides\n", Vkbd->NumOverrides);
+}
+
+static NTSTATUS
+__VkbdConnectInRing(
+    IN  PXENHID_VKBD                Vkbd
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    ULONG           Pages;
+    ULONG           Index;
+    ULONG           Length;
+    NTSTATUS        status;
+
+    if (!Vkbd->Extended) {
+        Vkbd->InRingLen = XENKBD_IN_RING_LEN;
+        return STATUS_SUCCESS;
+    }
+
+    Pages = 1 << Vkbd->InRingOrder;
+
+    status = STATUS_NO_MEMORY;
+    Vkbd->InRing = __VkbdAllocate(Pages * PAGE_SIZE);
+    if (Vkbd->InRing == NULL)
+        goto fail1;
+
+    for (Index = 0; Index < Pages; ++Index) {
+        PUCHAR  Page = (PUCHAR)Vkbd->InRing + (Index * PAGE_SIZE);
+
+        status = GNTTAB(Get, FdoGnttabInterface(Fdo), &Vkbd->InRingRef[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = GNTTAB(PermitForeignAccess,
+                        FdoGnttabInterface(Fdo),
+                        Vkbd->InRingRef[Index],
+                        FrontendGetBackendDomain(Vkbd->Frontend),
+                        GNTTAB_ENTRY_FULL_PAGE,
+                        __Pfn(Page),
+                        FALSE);
+        if (!NT_SUCCESS(status)) {
+            GNTTAB(Put, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+            Vkbd->InRingRef[Index] = 0;
+            goto fail2;
+        }
+    }
+
+    // largest power of 2 number of whole events that fit
+    Length = (Pages * PAGE_SIZE) / XENKBD_IN_EVENT_SIZE;
+    while (Length & (Length - 1))
+        Length &= Length - 1;
+    Vkbd->InRingLen = Length;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+    while (Index != 0) {
+        --Index;
+        GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+        GNTTAB(Put, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+        Vkbd->InRingRef[Index] = 0;
+    }
+    __VkbdFree(Vkbd->InRing);
+    Vkbd->InRing = NULL;
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+static VOID
+__VkbdDisconnectInRing(
+    IN  PXENHID_VKBD                Vkbd
+    )
+{
+    PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    ULONG           Index;
+
+    Vkbd->InRingLen = 0;
+
+    if (!Vkbd->Extended)
+        return;
+
+    for (Index = 0; Index < (1ul << Vkbd->InRingOrder); ++Index) {
+        GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+        GNTTAB(Put, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+        Vkbd->InRingRef[Index] = 0;
+    }
+
+    __VkbdFree(Vkbd->InRing);
+    Vkbd->InRing = NULL;
+}
+
 static NTSTATUS
 Vkbd_Connect(
     IN  PXENHID_CONTEXT             Context
@@ -605,9 +1782,86 @@ Vkbd_Connect(
     NTSTATUS        status;
     PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
     PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    PCHAR           Buffer;
 
     Trace("====>\n");
 
+    // Absolute positions are only requested if the backend offers them
+    // and they're wanted; otherwise the backend sends relative motion
+    Vkbd->AbsPointer = FALSE;
+    if (DriverGetParameters()->AbsPointer) {
+        status = STORE(Read,
+                        FdoStoreInterface(Fdo),
+                        NULL,
+                        FrontendGetBackendPath(Vkbd->Frontend),
+                        "feature-abs-pointer",
+                        &Buffer);
+        if (NT_SUCCESS(status)) {
+            Vkbd->AbsPointer = (strtoul(Buffer, NULL, 10) != 0) ? TRUE : FALSE;
+            STORE(Free, FdoStoreInterface(Fdo), Buffer);
+        }
+    }
+    Vkbd->Relative = !Vkbd->AbsPointer;
+
+    Info("%s pointer\n", Vkbd->AbsPointer ? "absolute" : "relative");
+
+    // Use a bigger in-ring, in pages of its own, if the backend can
+    Vkbd->Extended = FALSE;
+    Vkbd->InRingOrder = 0;
+    if (DriverGetParameters()->InRingPageOrder != 0) {
+        status = STORE(Read,
+                        FdoStoreInterface(Fdo),
+                        NULL,
+                        FrontendGetBackendPath(Vkbd->Frontend),
+                        "max-in-ring-page-order",
+                        &Buffer);
+        if (NT_SUCCESS(status)) {
+            ULONG   Order = (ULONG)strtoul(Buffer, NULL, 10);
+
+            STORE(Free, FdoStoreInterface(Fdo), Buffer);
+
+            Order = min(Order, DriverGetParameters()->InRingPageOrder);
+            Vkbd->InRingOrder = min(Order, VKBD_MAX_IN_RING_PAGE_ORDER);
+            Vkbd->Extended = TRUE;
+        }
+    }
+
+    // Latency measurement; the frontend stages are measured even if
+    // the backend can't stamp its events
+    Vkbd->Timestamps = DriverGetParameters()->Timestamps ? TRUE : FALSE;
+    Vkbd->BackendTimestamps = FALSE;
+    if (Vkbd->Timestamps) {
+        status = STORE(Read,
+                        FdoStoreInterface(Fdo),
+                        NULL,
+                        FrontendGetBackendPath(Vkbd->Frontend),
+                        "feature-timestamp",
+                        &Buffer);
+        if (NT_SUCCESS(status)) {
+            Vkbd->BackendTimestamps = (strtoul(Buffer, NULL, 10) != 0) ? TRUE : FALSE;
+            STORE(Free, FdoStoreInterface(Fdo), Buffer);
+        }
+    }
+    Vkbd->InterruptStamp = 0;
+    Vkbd->MinBackendDelta = MAXLONGLONG;
+
+    Vkbd->FeatureLeds = FALSE;
+    status = STORE(Read,
+                    FdoStoreInterface(Fdo),
+                    NULL,
+                    FrontendGetBackendPath(Vkbd->Frontend),
+                    "feature-leds",
+                    &Buffer);
+    if (NT_SUCCESS(status)) {
+        Vkbd->FeatureLeds = (strtoul(Buffer, NULL, 10) != 0) ? TRUE : FALSE;
+        STORE(Free, FdoStoreInterface(Fdo), Buffer);
+    }
+
+    // a new page starts with nothing sent
+    Vkbd->LedsSent = 0;
+
+    __VkbdLoadKeymap(Vkbd);
+
     status = STATUS_NO_MEMORY;
     Vkbd->Shared = __VkbdAllocate(PAGE_SIZE);
     if (Vkbd->Shared == NULL)
@@ -627,6 +1881,14 @@ Vkbd_Connect(
     if (!NT_SUCCESS(status))
         goto fail3;
 
+    status = __VkbdConnectInRing(Vkbd);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    Info("%s in-ring: %u events\n",
+         Vkbd->Extended ? "extended" : "legacy",
+         Vkbd->InRingLen);
+
     status = STATUS_UNSUCCESSFUL;
     Vkbd->Evtchn = EVTCHN(Open, 
                         FdoEvtchnInterface(Fdo),
@@ -636,11 +1898,21 @@ Vkbd_Connect(
                         FrontendGetBackendDomain(Vkbd->Frontend),
                         TRUE);
     if (Vkbd->Evtchn == NULL)
-        goto fail4;
+        goto fail5;
+
+    Vkbd->Connected = TRUE;
+    VkbdUnmask(Vkbd);
+
+    // tell a new backend about any LEDs already lit
+    if (Vkbd->FeatureLeds && Vkbd->Leds != 0)
+        (VOID) KeInsertQueueDpc(&Vkbd->OutDpc, NULL, NULL);
     
     Trace("<==== STATUS_SUCCESS\n");
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+    __VkbdDisconnectInRing(Vkbd);
 fail4:
     Error("fail4\n");
     GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->GrantRef);
@@ -657,6 +1929,116 @@ fail1:
     return status;
 }
 
+// After suspend/resume (e.g. migration) the backend is new but our
+// pages, grant references and negotiated features are not: re-grant
+// the same pages, re-open the channel and start the rings from empty.
+// Whatever the backend had not yet passed on is gone, so every key and
+// button is released rather than left stuck down.
+static NTSTATUS
+Vkbd_Resume(
+    IN  PXENHID_CONTEXT             Context
+    )
+{
+    NTSTATUS        status;
+    PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
+    PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    ULONG           Index;
+    KIRQL           Irql;
+
+    Trace("====>\n");
+
+    // once this is clear under the lock, no LED write is touching the
+    // out ring or the event channel, and none will until it is set again
+    KeAcquireSpinLock(&Vkbd->OutLock, &Irql);
+    Vkbd->Connected = FALSE;
+    KeReleaseSpinLock(&Vkbd->OutLock, Irql);
+
+    KeFlushQueuedDpcs();
+    (VOID) KeCancelTimer(&Vkbd->Timer);
+    KeFlushQueuedDpcs();
+    Vkbd->Polling = FALSE;
+    Vkbd->Stalled = FALSE;
+
+    EVTCHN(Close, FdoEvtchnInterface(Fdo), Vkbd->Evtchn);
+    Vkbd->Evtchn = NULL;
+
+    // the old grants are void, so revoke them before granting the
+    // same pages afresh
+    GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->GrantRef);
+    for (Index = 0; Vkbd->Extended && Index < (1ul << Vkbd->InRingOrder); ++Index)
+        GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->InRingRef[Index]);
+
+    RtlZeroMemory(Vkbd->Shared, PAGE_SIZE);
+    if (Vkbd->Extended)
+        RtlZeroMemory(Vkbd->InRing, (1ul << Vkbd->InRingOrder) * PAGE_SIZE);
+
+    // nothing has been sent to the new backend, whose clock may differ
+    Vkbd->LedsSent = 0;
+    Vkbd->MinBackendDelta = MAXLONGLONG;
+
+    status = GNTTAB(PermitForeignAccess, 
+                    FdoGnttabInterface(Fdo), 
+                    Vkbd->GrantRef, 
+                    FrontendGetBackendDomain(Vkbd->Frontend), 
+                    GNTTAB_ENTRY_FULL_PAGE, 
+                    __Pfn(Vkbd->Shared), 
+                    FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    for (Index = 0; Vkbd->Extended && Index < (1ul << Vkbd->InRingOrder); ++Index) {
+        PUCHAR  Page = (PUCHAR)Vkbd->InRing + (Index * PAGE_SIZE);
+
+        status = GNTTAB(PermitForeignAccess,
+                        FdoGnttabInterface(Fdo),
+                        Vkbd->InRingRef[Index],
+                        FrontendGetBackendDomain(Vkbd->Frontend),
+                        GNTTAB_ENTRY_FULL_PAGE,
+                        __Pfn(Page),
+                        FALSE);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+    }
+
+    status = STATUS_UNSUCCESSFUL;
+    Vkbd->Evtchn = EVTCHN(Open, 
+                        FdoEvtchnInterface(Fdo),
+                        EVTCHN_UNBOUND,
+                        VkbdInterrupt,
+                        Vkbd,
+                        FrontendGetBackendDomain(Vkbd->Frontend),
+                        TRUE);
+    if (Vkbd->Evtchn == NULL)
+        goto fail3;
+
+    KeAcquireSpinLock(&Vkbd->Lock, &Irql);
+    __Resync(Vkbd);
+    __Publish(Vkbd);
+    KeReleaseSpinLock(&Vkbd->Lock, Irql);
+
+    KeAcquireSpinLock(&Vkbd->OutLock, &Irql);
+    Vkbd->Connected = TRUE;
+    KeReleaseSpinLock(&Vkbd->OutLock, Irql);
+
+    VkbdUnmask(Vkbd);
+
+    if (Vkbd->FeatureLeds && Vkbd->Leds != 0)
+        (VOID) KeInsertQueueDpc(&Vkbd->OutDpc, NULL, NULL);
+
+    Trace("<==== STATUS_SUCCESS\n");
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+fail2:
+    Error("fail2\n");
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    // Vkbd_Disconnect() still releases the pages and references
+    return status;
+}
+
 static NTSTATUS
 Vkbd_WriteStore(
     IN  PXENHID_CONTEXT             Context,
@@ -692,9 +2074,82 @@ Vkbd_WriteStore(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    status = STORE(Printf,
+                    FdoStoreInterface(Fdo),
+                    Transaction,
+                    FdoGetStorePath(Fdo),
+                    "request-abs-update",
+                    "%u",
+                    Vkbd->AbsPointer ? 1 : 0);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    if (Vkbd->FeatureLeds) {
+        status = STORE(Printf,
+                        FdoStoreInterface(Fdo),
+                        Transaction,
+                        FdoGetStorePath(Fdo),
+                        "request-leds",
+                        "%u",
+                        1);
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
+
+    if (Vkbd->BackendTimestamps) {
+        status = STORE(Printf,
+                        FdoStoreInterface(Fdo),
+                        Transaction,
+                        FdoGetStorePath(Fdo),
+                        "request-timestamp",
+                        "%u",
+                        1);
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
+
+    if (Vkbd->Extended) {
+        ULONG   Index;
+
+        status = STORE(Printf,
+                        FdoStoreInterface(Fdo),
+                        Transaction,
+                        FdoGetStorePath(Fdo),
+                        "in-ring-page-order",
+                        "%u",
+                        Vkbd->InRingOrder);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+
+        for (Index = 0; Index < (1ul << Vkbd->InRingOrder); ++Index) {
+            CHAR    Name[sizeof("in-ring-refXX")];
+
+            status = RtlStringCbPrintfA(Name, sizeof(Name), "in-ring-ref%u", Index);
+            ASSERT(NT_SUCCESS(status));
+
+            status = STORE(Printf,
+                            FdoStoreInterface(Fdo),
+                            Transaction,
+                            FdoGetStorePath(Fdo),
+                            Name,
+                            "%u",
+                            Vkbd->InRingRef[Index]);
+            if (!NT_SUCCESS(status))
+                goto fail6;
+        }
+    }
+
     Trace("<==== STATUS_SUCCESS\n");
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+fail5:
+    Error("fail5\n");
+fail4:
+    Error("fail4\n");
+fail3:
+    Error("fail3\n");
 fail2:
     Error("fail2\n");
 fail1:
@@ -709,14 +2164,34 @@ Vkbd_Disconnect(
 {
     PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
     PXENHID_FDO     Fdo = FrontendGetFdo(Vkbd->Frontend);
+    KIRQL           Irql;
 
     Trace("====>\n");
 
+    // The DPC re-queues itself and re-arms the timer while the
+    // ring is busy, so stop it doing that before flushing
+    Vkbd->Connected = FALSE;
     KeFlushQueuedDpcs();
-
-    EVTCHN(Close, FdoEvtchnInterface(Fdo), Vkbd->Evtchn);
+    (VOID) KeCancelTimer(&Vkbd->Timer);
+    KeFlushQueuedDpcs();
+    Vkbd->Polling = FALSE;
+
+    // This context goes, and the next backend knows nothing of what
+    // this one had held down: release it all now, as a resume does,
+    // rather than leave hidclass holding keys or buttons until the
+    // next backend sends something
+    KeAcquireSpinLock(&Vkbd->Lock, &Irql);
+    __Resync(Vkbd);
+    __Publish(Vkbd);
+    KeReleaseSpinLock(&Vkbd->Lock, Irql);
+
+    // a failed resume leaves no channel open
+    if (Vkbd->Evtchn != NULL)
+        EVTCHN(Close, FdoEvtchnInterface(Fdo), Vkbd->Evtchn);
     Vkbd->Evtchn = NULL;
 
+    __VkbdDisconnectInRing(Vkbd);
+
     GNTTAB(RevokeForeignAccess, FdoGnttabInterface(Fdo), Vkbd->GrantRef);
     GNTTAB(Put, FdoGnttabInterface(Fdo), Vkbd->GrantRef);
     Vkbd->GrantRef = 0;
@@ -734,9 +2209,152 @@ Vkbd_DebugCallback(
     IN  PXENBUS_DEBUG_CALLBACK      DebugCallback
     )
 {
-    UNREFERENCED_PARAMETER(Context);
-    UNREFERENCED_PARAMETER(DebugInterface);
-    UNREFERENCED_PARAMETER(DebugCallback);
+    PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
+    XENHID_KEYBOARD KeyState;
+    XENHID_MOUSE    MouState;
+    XENHID_RELMOUSE RelState;
+
+    // the DPC may be running on another CPU
+    __ReadSnapshot(Vkbd, &KeyState, &MouState, &RelState);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Interrupts: %u DPCs: %u\n",
+            Vkbd->NumInts,
+            Vkbd->NumEvts);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "%s: Polls: %u Interrupts avoided: %u\n",
+            Vkbd->Polling ? "POLLING" : "INTERRUPT",
+            Vkbd->NumPolls,
+            Vkbd->NumMitigated);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Budget: %u events %u us Exhausted: %u\n",
+            Vkbd->EventBudget,
+            DriverGetParameters()->DpcTimeBudget,
+            Vkbd->NumExhausted);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "LEDs: %s %02x (sent %02x) Writes: %u Events: %u Notifies: %u Full: %u\n",
+            Vkbd->FeatureLeds ? "ON" : "OFF",
+            Vkbd->Leds,
+            Vkbd->LedsSent,
+            Vkbd->NumLedWrites,
+            Vkbd->NumLedEvents,
+            Vkbd->NumOutNotifies,
+            Vkbd->NumOutFull);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "FlowControl: %s%s Stalls: %u\n",
+            Vkbd->FlowControl ? "ON" : "OFF",
+            Vkbd->Stalled ? " (STALLED)" : "",
+            Vkbd->NumStalls);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Events: %u Reports: %u\n",
+            Vkbd->NumConsumed,
+            Vkbd->NumReports);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Snapshot: %u (retries %u)\n",
+            Vkbd->Snapshot.Sequence,
+            Vkbd->NumSnapshotRetries);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Keyboard%s: %02x [%02x %02x %02x %02x %02x %02x] Mouse: %02x Relative: %02x\n",
+            Vkbd->Nkro ? " (NKRO)" : "",
+            KeyState.Modifiers,
+            KeyState.Keys[0], KeyState.Keys[1], KeyState.Keys[2],
+            KeyState.Keys[3], KeyState.Keys[4], KeyState.Keys[5],
+            MouState.Buttons,
+            RelState.Buttons);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Pointer: every %lluus (bound %lluus) Shaped: %u Bypassed: %u\n",
+            __Microseconds(Vkbd, Vkbd->PointerInterval),
+            __Microseconds(Vkbd, Vkbd->PointerBound),
+            Vkbd->NumShaped,
+            Vkbd->NumBypassed);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Keymap: %u overrides\n",
+            Vkbd->NumOverrides);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Keyboard FIFO: %u/%u (max %u) Queued: %u Full: %u\n",
+            Vkbd->KeyFifoTail - Vkbd->KeyFifoHead,
+            VKBD_KEY_FIFO_LENGTH,
+            Vkbd->KeyFifoMax,
+            Vkbd->NumKeyQueued,
+            Vkbd->NumKeyFifoFull);
+
+    if (Vkbd->Timestamps) {
+        ULONG   Stage;
+
+        DEBUG(Printf,
+                DebugInterface,
+                DebugCallback,
+                "Latency (log2 us buckets, backend %s):\n",
+                Vkbd->BackendTimestamps ? "STAMPED" : "NOT STAMPED");
+
+        for (Stage = 0; Stage < VKBD_STAGE_COUNT; ++Stage) {
+            PULONG  Bucket = Vkbd->Histogram[Stage];
+
+            DEBUG(Printf,
+                    DebugInterface,
+                    DebugCallback,
+                    "%10s: %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u\n",
+                    VkbdStageName[Stage],
+                    Bucket[0], Bucket[1], Bucket[2], Bucket[3],
+                    Bucket[4], Bucket[5], Bucket[6], Bucket[7],
+                    Bucket[8], Bucket[9], Bucket[10], Bucket[11],
+                    Bucket[12], Bucket[13], Bucket[14], Bucket[15]);
+        }
+    }
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "In-ring: %s %u events (order %u)\n",
+            Vkbd->Extended ? "EXTENDED" : "LEGACY",
+            Vkbd->InRingLen,
+            Vkbd->InRingOrder);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Overruns: %u Dropped: %u\n",
+            Vkbd->NumOverruns,
+            Vkbd->NumDropped);
+
+    DEBUG(Printf,
+            DebugInterface,
+            DebugCallback,
+            "Pointer: %s (last %s)\n",
+            Vkbd->AbsPointer ? "ABSOLUTE" : "RELATIVE",
+            Vkbd->Relative ? "RELATIVE" : "ABSOLUTE");
 }
 
 static NTSTATUS
@@ -773,6 +2391,9 @@ Vkbd_GetDeviceDescriptor(
     OUT PULONG_PTR                  Information
     )
 {
+    PHID_DESCRIPTOR Descriptor = Buffer;
+
+    // fixed, so answered without a connection (Context may be NULL)
     UNREFERENCED_PARAMETER(Context);
 
     Trace("====>\n");
@@ -781,6 +2402,8 @@ Vkbd_GetDeviceDescriptor(
         goto fail1;
 
     RtlCopyMemory(Buffer, &Vkbd_DeviceDescriptor, sizeof(Vkbd_DeviceDescriptor));
+    if (DriverGetParameters()->Nkro)
+        Descriptor->DescriptorList[0].wReportLength = sizeof(Vkbd_NkroReportDescriptor);
     *Information = sizeof(Vkbd_DeviceDescriptor);
     
     Trace("<==== STATUS_SUCCESS\n");
@@ -799,14 +2422,27 @@ Vkbd_GetReportDescriptor(
     OUT PULONG_PTR                  Information
     )
 {
+    PUCHAR          Descriptor;
+    ULONG           Size;
+
+    // fixed, so answered without a connection (Context may be NULL)
     UNREFERENCED_PARAMETER(Context);
 
     Trace("====>\n");
-    if (Length < sizeof(Vkbd_ReportDescriptor))
+
+    if (DriverGetParameters()->Nkro) {
+        Descriptor = Vkbd_NkroReportDescriptor;
+        Size = sizeof(Vkbd_NkroReportDescriptor);
+    } else {
+        Descriptor = Vkbd_ReportDescriptor;
+        Size = sizeof(Vkbd_ReportDescriptor);
+    }
+
+    if (Length < Size)
         goto fail1;
 
-    RtlCopyMemory(Buffer, Vkbd_ReportDescriptor, sizeof(Vkbd_ReportDescriptor));
-    *Information = sizeof(Vkbd_ReportDescriptor);
+    RtlCopyMemory(Buffer, Descriptor, Size);
+    *Information = Size;
     
     Trace("<==== STATUS_SUCCESS\n");
     return STATUS_SUCCESS;
@@ -851,39 +2487,105 @@ Vkbd_SetFeature(
 }
 
 static NTSTATUS
-Vkbd_WriteReport(
+Vkbd_GetInputReport(
     IN  PXENHID_CONTEXT             Context,
+    IN  UCHAR                       ReportId,
     IN  PVOID                       Buffer,
-    IN  ULONG                       Length
+    IN  ULONG                       Length,
+    OUT PULONG_PTR                  Information
     )
 {
-    UNREFERENCED_PARAMETER(Context);
-    UNREFERENCED_PARAMETER(Buffer);
-    UNREFERENCED_PARAMETER(Length);
-    Trace("====>\n");
+    PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
+    PUCHAR          Report = Buffer;
+    XENHID_KEYBOARD KeyState;
+    XENHID_MOUSE    MouState;
+    XENHID_RELMOUSE RelState;
+    PVOID           Source;
+    ULONG           Size;
+    NTSTATUS        status;
 
-    Trace("<==== STATUS_NOT_SUPPORTED\n");
-    return STATUS_NOT_SUPPORTED;
+    // Called from the dispatch path, possibly while the DPC is
+    // updating the state on another CPU
+    __ReadSnapshot(Vkbd, &KeyState, &MouState, &RelState);
+
+    // Wheel and relative motion are deltas; they belong to the
+    // reports that were read, not to a poll of the current state
+    MouState.Z = 0;
+    RelState.X = RelState.Y = 0;
+    RelState.Z = 0;
+
+    // hidclass names the report in the packet; the buffer is only
+    // somewhere to put it
+    status = STATUS_INVALID_PARAMETER;
+    if (ReportId == KeyState.ReportId) {
+        Source = &KeyState;
+        Size = Vkbd->KeyLength;
+    } else if (ReportId == MouState.ReportId) {
+        Source = &MouState;
+        Size = sizeof(XENHID_MOUSE);
+    } else if (ReportId == RelState.ReportId) {
+        Source = &RelState;
+        Size = sizeof(XENHID_RELMOUSE);
+    } else {
+        goto fail1;
+    }
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < Size)
+        goto fail2;
+
+    RtlCopyMemory(Buffer, Source, Size);
+    Report[0] = ReportId;
+    *Information = Size;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
 }
 
-static FORCEINLINE NTSTATUS
-__Check(
-    IN  PXENHID_FRONTEND    Frontend,
-    IN  PBOOLEAN            Pending,
-    IN  PVOID               State,
-    IN  ULONG               Length
+static NTSTATUS
+Vkbd_WriteReport(
+    IN  PXENHID_CONTEXT             Context,
+    IN  PVOID                       Buffer,
+    IN  ULONG                       Length
     )
 {
-    NTSTATUS    status;
+    PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
+    PUCHAR          Report = Buffer;
+    KIRQL           Irql;
+    NTSTATUS        status;
 
-    status = STATUS_PENDING;
-    if (*Pending == TRUE) {
-        status = FrontendCompleteRead(Frontend, State, Length);
-        if (status == STATUS_SUCCESS) {
-            *Pending = FALSE;
-        }
-    }
+    // The keyboard LED output report: ID, then LED bits
+    status = STATUS_INVALID_PARAMETER;
+    if (Length < 2 || Report[0] != Vkbd->KeyState.ReportId)
+        goto fail1;
+
+    ++Vkbd->NumLedWrites;
+
+    // Recorded even before connecting, and with no feature-leds, so
+    // that a backend that turns out to want them gets the state
+    KeAcquireSpinLock(&Vkbd->OutLock, &Irql);
+    Vkbd->Leds = Report[1] & VKBD_LEDS_MASK;
+    KeReleaseSpinLock(&Vkbd->OutLock, Irql);
 
+    // Nowhere to send it; not an error as far as hidclass cares
+    if (!Vkbd->FeatureLeds)
+        return STATUS_SUCCESS;
+
+    // Writes made before the DPC runs are batched into one event and
+    // one notification (and none at all if the state didn't change)
+    if (Vkbd->Connected)
+        (VOID) KeInsertQueueDpc(&Vkbd->OutDpc, NULL, NULL);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
     return status;
 }
 
@@ -892,22 +2594,12 @@ Vkbd_ReadReport(
     IN  PXENHID_CONTEXT             Context
     )
 {
-    NTSTATUS        status;
     PXENHID_VKBD    Vkbd = (PXENHID_VKBD)Context;
 
-    status = __Check(Vkbd->Frontend,
-                    &Vkbd->KeyPending,
-                    &Vkbd->KeyState,
-                    sizeof(XENHID_KEYBOARD));
-    if (status != STATUS_PENDING)
-        return status;
-
-    status = __Check(Vkbd->Frontend,
-                    &Vkbd->MouPending,
-                    &Vkbd->MouState,
-                    sizeof(XENHID_MOUSE));
-    if (status != STATUS_PENDING)
-        return status;
+    // Anything held back, whether an unsent report or events left on
+    // the ring, is emitted by the DPC now that there is a read to take it
+    if (Vkbd->Connected)
+        (VOID) KeInsertQueueDpc(&Vkbd->Dpc, NULL, NULL);
 
     return STATUS_PENDING;
 }
@@ -916,6 +2608,7 @@ static XENHID_OPERATIONS Vkbd_Operations = {
     Vkbd_Create,
     Vkbd_Destroy,
     Vkbd_Connect,
+    Vkbd_Resume,
     Vkbd_WriteStore,
     Vkbd_Disconnect,
     Vkbd_DebugCallback,
@@ -924,6 +2617,7 @@ static XENHID_OPERATIONS Vkbd_Operations = {
     Vkbd_GetReportDescriptor,
     Vkbd_GetFeature,
     Vkbd_SetFeature,
+    Vkbd_GetInputReport,
     Vkbd_WriteReport,
     Vkbd_ReadReport
 };